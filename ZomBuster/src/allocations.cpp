@@ -0,0 +1,47 @@
+/* Copyright (C) 2015 Kristian Sloth Lauszus. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Sloth Lauszus
+ Web      :  http://www.lauszus.com
+ e-mail   :  lauszus@gmail.com
+*/
+
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+
+#include "allocations.h"
+
+static std::atomic<uint32_t> allocations;
+
+#if COUNT_ALLOCATIONS
+// Mat allocations are counted as well, as OpenCV allocates the reference counter using new
+void *operator new(size_t size) {
+    allocations++;
+    void *ptr = malloc(size);
+    if (ptr == NULL)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+#endif
+
+void resetAllocationCount(void) {
+    allocations = 0;
+}
+
+uint32_t getAllocationCount(void) {
+    return allocations;
+}
@@ -0,0 +1,28 @@
+/* Copyright (C) 2015 Kristian Sloth Lauszus. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Sloth Lauszus
+ Web      :  http://www.lauszus.com
+ e-mail   :  lauszus@gmail.com
+*/
+
+#ifndef __allocations_h__
+#define __allocations_h__
+
+#include <stdint.h>
+
+// Build with "make COUNT_ALLOCATIONS=1" to count all heap allocations, i.e. to check that the filters do not allocate any memory
+// after the first frame. Otherwise the count is always zero
+void resetAllocationCount(void);
+uint32_t getAllocationCount(void);
+
+#endif
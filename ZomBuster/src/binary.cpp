@@ -0,0 +1 @@
+../../exercise3/src/binary.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../exercise3/src/distance.cpp
\ No newline at end of file
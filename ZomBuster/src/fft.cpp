@@ -0,0 +1 @@
+../../exercise3/src/fft.cpp
\ No newline at end of file
@@ -18,12 +18,15 @@
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 
+#include "allocations.h"
+#include "binary.h"
 #include "contours.h"
 #include "euler.h"
 #include "filter.h"
 #include "histogram.h"
 #include "moments.h"
 #include "segmentation.h"
+#include "threadpool.h"
 
 #define WRITE_IMAGES    0
 #define PRINT_TIMING    0
@@ -186,6 +189,12 @@ int main(int argc, char *argv[]) {
     capture.set(CV_CAP_PROP_FRAME_WIDTH, 320);
     capture.set(CV_CAP_PROP_FRAME_HEIGHT, 240);
 
+    // The filters write into these buffers, so no memory is allocated every frame
+    Mat imgThresholded, fractileFilterBuffer;
+    ImageBuffer cropBuffer;
+    PingPongBuffer morphologicalBuffer;
+    BinaryImage binaryBuffers[2]; // The mask is packed into bits during the morphological filtering
+
 #if __arm__
     if (wiringPiSetup() == -1) { // Setup WiringPi
         printf("wiringPiSetup failed!\n");
@@ -243,7 +252,7 @@ int main(int argc, char *argv[]) {
         timer = (double)getTickCount();
 #endif
 
-        Mat imgThresholded(image.size(), CV_8UC1);
+        imgThresholded.create(image.size(), CV_8UC1);
         Scalar low = Scalar(iLowH, iLowS, iLowV);
         Scalar high = Scalar(iHighH, iHighS, iHighV);
 
@@ -272,10 +281,16 @@ int main(int argc, char *argv[]) {
         imwrite("img/imgThresholded.png", imgThresholded);
 #endif
 
+#if COUNT_ALLOCATIONS
+        resetAllocationCount();
+#endif
+
         // Apply fractile filter to remove salt- and pepper noise
-        Mat fractileFilterImg = fractileFilter(&imgThresholded, windowSize, percentile, true);
+        binaryFractileFilter(&imgThresholded, &fractileFilterBuffer, windowSize, percentile, true); // The thresholded image only contains 0 and 255
+        Mat fractileFilterImg = fractileFilterBuffer;
 #if PRINT_TIMING
         printf("Fractile filter = %f ms\t", ((double)getTickCount() - timer) / getTickFrequency() * 1000.0);
+        ThreadPool::getInstance().printBandTimings(); // Show how the work was distributed between the threads
         timer = (double)getTickCount();
 #endif
         //imshow("Fractile filter", fractileFilterImg);
@@ -326,7 +341,8 @@ int main(int argc, char *argv[]) {
         if (minY + height >= fractileFilterImg.size().height)
             height = fractileFilterImg.size().height - 1 - minY;
 
-        fractileFilterImg = Mat(fractileFilterImg, Rect(minX, minY, width, height)).clone(); // Do the actual cropping
+        Mat(fractileFilterImg, Rect(minX, minY, width, height)).copyTo(*cropBuffer.get(Size(width, height), CV_8UC1)); // Do the actual cropping
+        fractileFilterImg = *cropBuffer.get();
 #else
         int minX = 0, minY = 0;
 #endif
@@ -336,15 +352,17 @@ int main(int argc, char *argv[]) {
         timer = (double)getTickCount();
 #endif
 
-        // Apply morphological closing and opening
-        Mat morphologicalFilterImg = fractileFilterImg.clone();
-        // Morphological closing (Remove small dark spots (i.e. "pepper") and connect small bright cracks)
-        morphologicalFilterImg = morphologicalFilter(&morphologicalFilterImg, DILATION, closingSize, true);
-        morphologicalFilterImg = morphologicalFilter(&morphologicalFilterImg, EROSION, closingSize, true);
-
-        // Morphological opening (Remove small bright spots (i.e. "salt") and connect small dark cracks)
-        morphologicalFilterImg = morphologicalFilter(&morphologicalFilterImg, EROSION, openingSize, true);
-        morphologicalFilterImg = morphologicalFilter(&morphologicalFilterImg, DILATION, openingSize, true);
+        // Apply morphological closing and opening. The mask only contains 0 and 255, so it is packed into bits once and converted back at the end
+        // Closing removes small dark spots (i.e. "pepper") and connects small bright cracks
+        // Opening removes small bright spots (i.e. "salt") and connects small dark cracks
+        binaryBuffers[0].fromMat(&fractileFilterImg);
+        binaryCloseThenOpen(&binaryBuffers[0], &binaryBuffers[1], closingSize, openingSize, true);
+        binaryBuffers[1].toMat(morphologicalBuffer.back(fractileFilterImg.size(), CV_8UC1));
+        morphologicalBuffer.swap();
+        Mat morphologicalFilterImg = *morphologicalBuffer.front();
+#if COUNT_ALLOCATIONS
+        printf("Allocations = %u\n", getAllocationCount()); // The filters should not allocate any memory after the first frame
+#endif
         //imshow("Morphological", morphologicalFilterImg);
 #if WRITE_IMAGES
         imwrite("img/morphologicalFilterImg.png", morphologicalFilterImg);
@@ -380,7 +398,8 @@ int main(int argc, char *argv[]) {
                 image = drawMoments(&image, &momentsTmp, hypotenuse / 9.0f, 0); // Draw center of mass on original image
                 moments[objectsDetected++] = momentsTmp; // Save the moments of detected objects
     #if 0 // Use Laplacian filter with lowpass filter to draw the contour
-                static LinearFilter lowpassLaplacianFilter = LaplacianFilter() + LowpassFilter();
+                // The gain undoes the normalization of the lowpass filter, just like when the kernels are combined using the + operator
+                static LinearFilterChain lowpassLaplacianFilter = LinearFilterChain(LaplacianFilter()).add(LowpassFilter(), 9);
                 Mat contour = lowpassLaplacianFilter.apply(&segments[i]); // Calculate contour
     #elif 0 // Use Laplacian filter to draw the contour
                 static LaplacianFilter laplacianFilter;
@@ -0,0 +1 @@
+../../exercise3/src/reconstruction.cpp
\ No newline at end of file
@@ -18,6 +18,7 @@
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 
+#include "border.h"
 #include "segmentation.h"
 
 using namespace cv;
@@ -25,21 +26,21 @@ using namespace cv;
 static const uint8_t MAX_SEGMENTS = 10;
 static Mat segmentImg[MAX_SEGMENTS];
 
-static uint8_t checkNeighbours(const Mat *image, const Mat *segments, const size_t index, const int8_t neighbourSize, bool whitePixels) {
-    const Size size = image->size();
-    const int width = size.width;
-    const size_t total = image->total();
+static PaddedImage paddedImage; // Kept between frames
 
+// The image and the segments are padded, so the neighbours can be checked without any bounds checking.
+// 'image' and 'segments' point to the current pixel and 'stride' is the width of the padded images
+static uint8_t checkNeighbours(const uchar *image, const uchar *segments, const int stride, const int8_t neighbourSize, bool whitePixels) {
     uint8_t id = 0;
 
     // Check all neighbors using 8-connectedness
     for (int8_t i = -neighbourSize; i <= neighbourSize; i++) {
         for (int8_t j = -neighbourSize; j <= neighbourSize; j++) {
-            int32_t subIndex = index + i * width + j;
-            if (!(i == 0 && j == 0) && subIndex >= 0 && subIndex < total) { // Do not check x,y = (0,0) and prevent overflow
-                if ((bool)image->data[subIndex] == whitePixels) {
-                    if (segments->data[subIndex] > 0) // Part of an existing segment
-                        return segments->data[subIndex]; // Return ID
+            const int offset = i * stride + j;
+            if (!(i == 0 && j == 0)) { // Do not check x,y = (0,0)
+                if ((bool)image[offset] == whitePixels) {
+                    if (segments[offset] > 0) // Part of an existing segment
+                        return segments[offset]; // Return ID
                     else
                         id = 255; // Part of a new segments, but keep looping as there might be a neighbor with an existing ID
                 }
@@ -56,24 +57,28 @@ Mat *getSegments(const Mat *image, uint8_t *nSegments, const int8_t neighbourSiz
     const int width = size.width;
     const int height = size.height;
 
-    Mat segments(size, image->type()); // This Mat variable is used to store the ID of the different segments
-    memset(segments.data, 0, image->total());
+    // Pixels outside the image are set to the opposite of the pixels we are looking for, so they are never part of a segment
+    paddedImage.pad(image, neighbourSize, neighbourSize, PAD_CONSTANT, whitePixels ? 0 : 255);
+    const int stride = width + 2 * neighbourSize;
+
+    Mat segments(Size(stride, height + 2 * neighbourSize), image->type()); // This Mat variable is used to store the ID of the different segments. It is padded just like the image
+    memset(segments.data, 0, segments.total());
 
     // Look for segments
-    size_t index = 0;
     *nSegments = 0;
-    for (size_t y = 0; y < height; y++) {
-        for (size_t x = 0; x < width; x++) {
-            if ((bool)image->data[index] == whitePixels) { // Check if we have found a pixel
-                uint8_t id = checkNeighbours(image, &segments, index, neighbourSize, whitePixels);
+    for (int y = 0; y < height; y++) {
+        const uchar *src = paddedImage.ptr(0, y);
+        uchar *dst = &segments.data[(y + neighbourSize) * stride + neighbourSize];
+        for (int x = 0; x < width; x++) {
+            if ((bool)src[x] == whitePixels) { // Check if we have found a pixel
+                uint8_t id = checkNeighbours(&src[x], &dst[x], stride, neighbourSize, whitePixels);
                 if (id > 0) {
                     if (id == 255) // New segment
                         id = ++(*nSegments); // Set ID equal to the current number of found segments
-                    segments.data[index] = id; // Set same ID as neighbor
+                    dst[x] = id; // Set same ID as neighbor
                 } else
-                    segments.data[index] = 0; // No neighbors, just assume it is noise
+                    dst[x] = 0; // No neighbors, just assume it is noise
             }
-            index++; // Increment index
         }
     }
 
@@ -90,9 +95,12 @@ Mat *getSegments(const Mat *image, uint8_t *nSegments, const int8_t neighbourSiz
         }
 
         for (uint8_t id = 1; id <= *nSegments; id++) {
-            for (size_t j = 0; j < width * height; j++) {
-                if (segments.data[j] == id)
-                    segmentImg[id - 1].data[j] = 255; // Draw white on each segment
+            for (int y = 0; y < height; y++) {
+                const uchar *src = &segments.data[(y + neighbourSize) * stride + neighbourSize];
+                for (int x = 0; x < width; x++) {
+                    if (src[x] == id)
+                        segmentImg[id - 1].data[y * width + x] = 255; // Draw white on each segment
+                }
             }
 #if 0
             char buf[20];
@@ -0,0 +1 @@
+../../exercise3/src/threadpool.cpp
\ No newline at end of file
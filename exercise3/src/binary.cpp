@@ -0,0 +1,270 @@
+/* Copyright (C) 2015 Kristian Sloth Lauszus. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Sloth Lauszus
+ Web      :  http://www.lauszus.com
+ e-mail   :  lauszus@gmail.com
+*/
+
+#include <opencv2/core.hpp>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "binary.h"
+#include "threadpool.h"
+
+using namespace cv;
+
+void packBinaryRow(const uchar *pixels, const int n, uint64_t *bits) {
+    int x = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 64 <= n; x += 64) {
+        uint64_t word = 0;
+        for (uint8_t i = 0; i < 4; i++) {
+            const __m128i v = _mm_loadu_si128((const __m128i*)&pixels[x + i * 16]);
+            word |= (uint64_t)(~_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) & 0xFFFF) << (i * 16);
+        }
+        bits[x / 64] = word;
+    }
+#endif
+    for (; x < n; x += 64) {
+        uint64_t word = 0;
+        for (int i = 0; i < min(64, n - x); i++)
+            word |= (uint64_t)(pixels[x + i] != 0) << i;
+        bits[x / 64] = word;
+    }
+}
+
+// Arguments passed to the band functions converting to and from a Mat
+typedef struct {
+    const Mat *image;
+    BinaryImage *binaryImage;
+} from_mat_band_t;
+
+typedef struct {
+    const BinaryImage *binaryImage;
+    Mat *image;
+} to_mat_band_t;
+
+static void fromMatBand(void *arg, int yStart, int yStop) {
+    const from_mat_band_t *band = (const from_mat_band_t*)arg;
+    for (int y = yStart; y < yStop; y++)
+        packBinaryRow(band->image->ptr(y), band->image->size().width, band->binaryImage->row(y));
+}
+
+// The eight pixels of every possible byte, so a byte is unpacked with a single lookup
+struct unpack_table_t {
+    unpack_table_t(void) {
+        for (uint16_t i = 0; i < 256; i++) {
+            for (uint8_t j = 0; j < 8; j++)
+                pixels[i][j] = (i >> j) & 1 ? 255 : 0;
+        }
+    }
+    uchar pixels[256][8];
+};
+
+static void toMatBand(void *arg, int yStart, int yStop) {
+    static const unpack_table_t table;
+    const to_mat_band_t *band = (const to_mat_band_t*)arg;
+    const int width = band->image->size().width;
+    for (int y = yStart; y < yStop; y++) {
+        const uint8_t *bytes = (const uint8_t*)band->binaryImage->row(y); // Pixel x is bit x % 8 of byte x / 8 on a little-endian processor
+        uchar *out = band->image->ptr(y);
+        int x = 0;
+        for (; x + 8 <= width; x += 8)
+            memcpy(&out[x], table.pixels[bytes[x / 8]], 8);
+        for (; x < width; x++)
+            out[x] = table.pixels[bytes[x / 8]][x % 8];
+    }
+}
+
+void BinaryImage::fromMat(const Mat *image) {
+    assert(image->channels() == 1); // The image must be in black and white
+    create(image->size());
+    from_mat_band_t band = { image, this };
+    ThreadPool::getInstance().run(fromMatBand, &band, height);
+}
+
+void BinaryImage::toMat(Mat *image) const {
+    image->create(size(), CV_8UC1);
+    to_mat_band_t band = { this, image };
+    ThreadPool::getInstance().run(toMatBand, &band, height);
+}
+
+// Arguments passed to the band functions of the binary morphological filter
+typedef struct {
+    const BinaryImage *image;
+    BinaryImage *rows; // Result of the horizontal pass
+    BinaryImage *filteredImage;
+    int n;
+    BorderMode border;
+} binary_morphological_band_t;
+
+template<bool useOr>
+static inline uint64_t andOr(const uint64_t a, const uint64_t b) {
+    return useOr ? a | b : a & b;
+}
+
+// Word w of a row of bits shifted s bits towards bit 0, so bit x is bit x + s of the row
+static inline uint64_t shiftedWord(const uint64_t *bits, const int w, const int s) {
+    const int q = s / 64, r = s % 64;
+    return r ? (bits[w + q] >> r) | (bits[w + q + 1] << (64 - r)) : bits[w + q];
+}
+
+// The row is padded with n pixels on each side. Bit x of the window [x; x + m - 1] is found by doubling the size of the window
+// from a single pixel, i.e. the window of size 2m is the window of size m combined with the same window shifted m pixels.
+// The final window of size k is the largest power of two p <= k combined with itself shifted k - p pixels. This takes log2(k) word operations per 64 pixels
+template<bool useOr>
+static void binaryMorphologicalRowsBand(void *arg, int yStart, int yStop) {
+    const binary_morphological_band_t *band = (const binary_morphological_band_t*)arg;
+    const BinaryImage *image = band->image;
+    const int width = image->size().width, n = band->n, k = 2 * n + 1;
+    const int length = width + 2 * n; // Length of the padded row
+    const int paddedWords = length / 64 + 1;
+    const int bufferWords = paddedWords + k / 64 + 2; // The shifted words are read beyond the padded row
+
+    static thread_local std::vector<uint64_t> aBuffer, bBuffer; // Kept between frames
+    aBuffer.resize(max((size_t)bufferWords, aBuffer.size()));
+    bBuffer.resize(max((size_t)bufferWords, bBuffer.size()));
+    memset(bBuffer.data(), 0, bufferWords * sizeof(uint64_t)); // Only the words of the padded row are written below
+
+    for (int y = yStart; y < yStop; y++) {
+        uint64_t *cur = aBuffer.data(), *next = bBuffer.data();
+        memset(cur, 0, bufferWords * sizeof(uint64_t));
+
+        // Copy the row n bits into the padded row
+        const uint64_t *src = image->row(y);
+        const int q = n / 64, r = n % 64;
+        for (int w = 0; w < image->getWords(); w++) {
+            cur[w + q] |= src[w] << r;
+            if (r)
+                cur[w + q + 1] |= src[w] >> (64 - r);
+        }
+
+        // Fill the border, which is only n bits on each side
+        for (int i = 0; i < n; i++) {
+            const int left = borderIndex(i - n, width, band->border), right = borderIndex(width + i, width, band->border);
+            if (left >= 0 && image->get(left, y))
+                cur[i / 64] |= 1ULL << (i % 64);
+            if (right >= 0 && image->get(right, y))
+                cur[(n + width + i) / 64] |= 1ULL << ((n + width + i) % 64);
+        }
+
+        int m = 1;
+        for (; 2 * m <= k; m *= 2) {
+            for (int w = 0; w < paddedWords; w++)
+                next[w] = andOr<useOr>(cur[w], shiftedWord(cur, w, m));
+            std::swap(cur, next);
+        }
+
+        uint64_t *dst = band->rows->row(y);
+        for (int w = 0; w < image->getWords(); w++)
+            dst[w] = andOr<useOr>(cur[w], shiftedWord(cur, w, k - m));
+        if (width % 64)
+            dst[image->getWords() - 1] &= (1ULL << (width % 64)) - 1; // Clear the bits after the last pixel
+    }
+}
+
+// Row r of the image extended by the border, where PAD_CONSTANT rows are all black
+static inline const uint64_t *paddedRow(const BinaryImage *image, const int r, const BorderMode border, const uint64_t *zeros) {
+    const int i = borderIndex(r, image->size().height, border);
+    return i >= 0 ? image->row(i) : zeros;
+}
+
+// The vertical pass uses the van Herk/Gil-Werman algorithm just like morphologicalFilter, but on whole words,
+// so it takes three word operations per 64 pixels regardless of the size of the structuring element
+template<bool useOr>
+static void binaryMorphologicalColumnsBand(void *arg, int yStart, int yStop) {
+    const binary_morphological_band_t *band = (const binary_morphological_band_t*)arg;
+    const BinaryImage *rows = band->rows;
+    const int words = rows->getWords();
+    const int n = band->n, k = 2 * n + 1;
+    const int length = yStop - yStart + 2 * n; // The rows of the windows of the band
+
+    static thread_local std::vector<uint64_t> gBuffer, hBuffer, zeroBuffer; // Kept between frames
+    gBuffer.resize(max((size_t)length * words, gBuffer.size()));
+    hBuffer.resize(max((size_t)length * words, hBuffer.size()));
+    zeroBuffer.assign(max((size_t)words, zeroBuffer.size()), 0);
+    uint64_t * __restrict g = gBuffer.data();
+    uint64_t * __restrict h = hBuffer.data();
+
+    // Row i of the band is row yStart - n + i of the padded image
+    for (int b = 0; b < length; b += k) {
+        const int e = min(b + k, length); // End of the block
+        memcpy(&g[b * words], paddedRow(rows, yStart - n + b, band->border, zeroBuffer.data()), words * sizeof(uint64_t));
+        for (int i = b + 1; i < e; i++) {
+            const uint64_t *row = paddedRow(rows, yStart - n + i, band->border, zeroBuffer.data());
+            for (int w = 0; w < words; w++)
+                g[i * words + w] = andOr<useOr>(g[(i - 1) * words + w], row[w]);
+        }
+        memcpy(&h[(e - 1) * words], paddedRow(rows, yStart - n + e - 1, band->border, zeroBuffer.data()), words * sizeof(uint64_t));
+        for (int i = e - 2; i >= b; i--) {
+            const uint64_t *row = paddedRow(rows, yStart - n + i, band->border, zeroBuffer.data());
+            for (int w = 0; w < words; w++)
+                h[i * words + w] = andOr<useOr>(h[(i + 1) * words + w], row[w]);
+        }
+    }
+
+    for (int y = yStart; y < yStop; y++) {
+        const int i = y - yStart;
+        uint64_t *dst = band->filteredImage->row(y);
+        for (int w = 0; w < words; w++)
+            dst[w] = andOr<useOr>(h[i * words + w], g[(i + k - 1) * words + w]);
+    }
+}
+
+void binaryMorphologicalFilter(const BinaryImage *image, BinaryImage *filteredImage, MorphologicalType type, const uint8_t structuringElementSize, bool whitePixels, BorderMode border) {
+    assert(image != filteredImage); // The filter can not be applied in-place
+
+    const uint8_t n = (structuringElementSize - 1)/2;
+    const int height = image->size().height;
+    filteredImage->create(image->size());
+    if (n == 0) {
+        for (int y = 0; y < height; y++) // The structuring element is a single pixel
+            memcpy(filteredImage->row(y), image->row(y), image->getWords() * sizeof(uint64_t));
+        return;
+    }
+
+    static thread_local BinaryImage rows; // Kept between frames
+    rows.create(image->size());
+
+    const bool useOr = (type == DILATION && whitePixels) || (type == EROSION && !whitePixels); // OR is used for dilation when looking for white pixels
+    binary_morphological_band_t band = { image, &rows, filteredImage, n, border };
+    ThreadPool::getInstance().run(useOr ? binaryMorphologicalRowsBand<true> : binaryMorphologicalRowsBand<false>, &band, height);
+    ThreadPool::getInstance().run(useOr ? binaryMorphologicalColumnsBand<true> : binaryMorphologicalColumnsBand<false>, &band, height);
+}
+
+void binaryCloseThenOpen(const BinaryImage *image, BinaryImage *filteredImage, const uint8_t closingSize, const uint8_t openingSize, bool whitePixels, BorderMode border) {
+    static thread_local BinaryImage buffers[2]; // Kept between frames
+    binaryMorphologicalFilter(image, &buffers[0], DILATION, closingSize, whitePixels, border); // Closing
+    binaryMorphologicalFilter(&buffers[0], &buffers[1], EROSION, closingSize, whitePixels, border);
+    binaryMorphologicalFilter(&buffers[1], &buffers[0], EROSION, openingSize, whitePixels, border); // Opening
+    binaryMorphologicalFilter(&buffers[0], filteredImage, DILATION, openingSize, whitePixels, border);
+}
+
+Mat binaryMorphologicalFilter(const Mat *image, MorphologicalType type, const uint8_t structuringElementSize, bool whitePixels, BorderMode border) {
+    Mat filteredImage;
+    binaryMorphologicalFilter(image, &filteredImage, type, structuringElementSize, whitePixels, border);
+    return filteredImage;
+}
+
+void binaryMorphologicalFilter(const Mat *image, Mat *filteredImage, MorphologicalType type, const uint8_t structuringElementSize, bool whitePixels, BorderMode border) {
+    assert(image->data != filteredImage->data); // The filter can not be applied in-place
+
+    static thread_local BinaryImage in, out; // Kept between frames
+    in.fromMat(image);
+    binaryMorphologicalFilter(&in, &out, type, structuringElementSize, whitePixels, border);
+    out.toMat(filteredImage);
+}
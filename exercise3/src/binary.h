@@ -0,0 +1,94 @@
+/* Copyright (C) 2015 Kristian Sloth Lauszus. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Sloth Lauszus
+ Web      :  http://www.lauszus.com
+ e-mail   :  lauszus@gmail.com
+*/
+
+#ifndef __binary_h__
+#define __binary_h__
+
+#include <vector>
+
+#include "border.h"
+#include "filter.h"
+
+using namespace cv;
+
+// Pack n pixels into bits, where every non-zero pixel is set. Pixel x is bit x % 64 of word x / 64
+void packBinaryRow(const uchar *pixels, const int n, uint64_t *bits);
+
+// Black and white image with one bit per pixel, so operations on the image work on 64 pixels at a time.
+// Every row starts at a new word and the bits after the last pixel in a row are always zero.
+// The memory is kept between frames and is only reallocated if the image grows beyond the capacity, just like ImageBuffer
+class BinaryImage {
+public:
+    BinaryImage(void) :
+        width(0),
+        height(0),
+        words(0) {
+    }
+
+    void create(const Size size) {
+        width = size.width;
+        height = size.height;
+        words = (width + 63) / 64;
+        if (data.size() < (size_t)words * height)
+            data.resize(words * height);
+    }
+
+    // Convert a black and white image, where every non-zero pixel is treated as white
+    void fromMat(const Mat *image);
+
+    // Convert to an image, where white pixels are set to 255
+    void toMat(Mat *image) const;
+
+    inline uint64_t *row(const int y) {
+        return &data[y * words];
+    }
+
+    inline const uint64_t *row(const int y) const {
+        return &data[y * words];
+    }
+
+    inline bool get(const int x, const int y) const {
+        return (row(y)[x / 64] >> (x % 64)) & 1;
+    }
+
+    // Number of words in a row
+    int getWords(void) const {
+        return words;
+    }
+
+    Size size(void) const {
+        return Size(width, height);
+    }
+
+private:
+    std::vector<uint64_t> data;
+    int width, height, words;
+};
+
+// Erosion and dilation of a binary image with a square structuring element. It gives the same result as morphologicalFilter,
+// but works on 64 pixels at a time using shifts and AND/OR of whole words. The destination can not be the same as the source image
+void binaryMorphologicalFilter(const BinaryImage *image, BinaryImage *filteredImage, MorphologicalType type, const uint8_t structuringElementSize, bool whitePixels, BorderMode border = PAD_REPLICATE);
+
+// Morphological closing followed by opening just like closeThenOpen. The packed image is small enough to stay in the cache,
+// so the steps are simply applied one by one
+void binaryCloseThenOpen(const BinaryImage *image, BinaryImage *filteredImage, const uint8_t closingSize, const uint8_t openingSize, bool whitePixels, BorderMode border = PAD_REPLICATE);
+
+// Drop in replacement for morphologicalFilter for images only containing 0 and 255. The image is converted to and from a BinaryImage
+Mat binaryMorphologicalFilter(const Mat *image, MorphologicalType type, const uint8_t structuringElementSize, bool whitePixels, BorderMode border = PAD_REPLICATE);
+void binaryMorphologicalFilter(const Mat *image, Mat *filteredImage, MorphologicalType type, const uint8_t structuringElementSize, bool whitePixels, BorderMode border = PAD_REPLICATE);
+
+#endif
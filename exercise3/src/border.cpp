@@ -0,0 +1,124 @@
+/* Copyright (C) 2015 Kristian Sloth Lauszus. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Sloth Lauszus
+ Web      :  http://www.lauszus.com
+ e-mail   :  lauszus@gmail.com
+*/
+
+#include <opencv2/core.hpp>
+
+#include "border.h"
+#include "misc.h"
+#include "threadpool.h"
+
+using namespace cv;
+
+int borderIndex(int i, const int length, const BorderMode mode) {
+    if (i >= 0 && i < length)
+        return i;
+
+    switch (mode) {
+        case PAD_REPLICATE:
+            return i < 0 ? 0 : length - 1;
+        case PAD_REFLECT:
+            i %= 2 * length; // The reflected image repeats with a period of twice the length
+            if (i < 0)
+                i += 2 * length;
+            return i < length ? i : 2 * length - 1 - i;
+        case PAD_WRAP:
+            i %= length;
+            return i < 0 ? i + length : i;
+        default:
+            return -1;
+    }
+}
+
+// Arguments passed to the band function of PaddedImage
+typedef struct {
+    const Mat *image;
+    Mat *buffer;
+    uint16_t top, left;
+    BorderMode mode;
+    const uchar *pixel; // Value of a pixel outside the image when using PAD_CONSTANT
+} padded_image_band_t;
+
+static inline void paddedImagePixel(const padded_image_band_t *band, uchar *dst, const uchar *src, const int x, const int width, const size_t elemSize) {
+    const int column = borderIndex(x, width, band->mode);
+    memcpy(&dst[(x + band->left) * elemSize], column < 0 ? band->pixel : &src[column * elemSize], elemSize);
+}
+
+// Every row of the band is copied from the row it is replaced with, after which the left and right border is filled in
+static void paddedImageBand(void *arg, int yStart, int yStop) {
+    const padded_image_band_t *band = (const padded_image_band_t*)arg;
+    const int width = band->image->size().width;
+    const int height = band->image->size().height;
+    const int paddedWidth = band->buffer->size().width;
+    const size_t elemSize = band->image->elemSize();
+
+    for (int y = yStart; y < yStop; y++) {
+        uchar *dst = &band->buffer->data[y * paddedWidth * elemSize];
+        const int row = borderIndex(y - band->top, height, band->mode);
+        if (row < 0) { // Constant row
+            for (int x = 0; x < paddedWidth; x++)
+                memcpy(&dst[x * elemSize], band->pixel, elemSize);
+            continue;
+        }
+
+        const uchar *src = &band->image->data[row * width * elemSize];
+        memcpy(&dst[band->left * elemSize], src, width * elemSize);
+        for (int x = -band->left; x < 0; x++) // Left border
+            paddedImagePixel(band, dst, src, x, width, elemSize);
+        for (int x = width; x < paddedWidth - band->left; x++) // Right border
+            paddedImagePixel(band, dst, src, x, width, elemSize);
+    }
+}
+
+void PaddedImage::pad(const Mat *image, const uint16_t _top, const uint16_t bottom, const uint16_t _left, const uint16_t right, const BorderMode mode, const double value) {
+    assert(image->channels() <= 4);
+    width = image->size().width;
+    height = image->size().height;
+    top = _top;
+    left = _left;
+
+    const Size paddedSize(width + left + right, height + top + bottom);
+    const size_t bytes = paddedSize.area() * CV_ELEM_SIZE(image->type());
+    if (storage.total() < bytes)
+        storage.create(1, bytes, CV_8UC1);
+    buffer = Mat(paddedSize, image->type(), storage.data); // Only creates a new header
+
+    // Convert the constant into the type of the image
+    double pixel[4]; // Large enough for four channels of any type
+    uchar *constant = (uchar*)pixel;
+    for (uint8_t i = 0; i < image->channels(); i++) {
+        switch (image->depth()) {
+            case CV_8U:
+                constant[i] = constrain(value, 0, 255);
+                break;
+            case CV_16S:
+                ((int16_t*)constant)[i] = constrain(value, INT16_MIN, INT16_MAX);
+                break;
+            case CV_32S:
+                ((int32_t*)constant)[i] = value;
+                break;
+            case CV_32F:
+                ((float*)constant)[i] = value;
+                break;
+            default:
+                assert(0); // Type is not supported
+                break;
+        }
+    }
+
+    padded_image_band_t band = { image, &buffer, top, left, mode, constant };
+    ThreadPool::getInstance().run(paddedImageBand, &band, buffer.size().height);
+}
@@ -0,0 +1,85 @@
+/* Copyright (C) 2015 Kristian Sloth Lauszus. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Sloth Lauszus
+ Web      :  http://www.lauszus.com
+ e-mail   :  lauszus@gmail.com
+*/
+
+#ifndef __border_h__
+#define __border_h__
+
+using namespace cv;
+
+// How pixels outside the image are extended, shown for a row "abcdefgh"
+enum BorderMode {
+    PAD_CONSTANT = 0, // iiii|abcdefgh|iiii, where i is a given value
+    PAD_REPLICATE, // aaaa|abcdefgh|hhhh
+    PAD_REFLECT, // dcba|abcdefgh|hgfe
+    PAD_WRAP, // efgh|abcdefgh|abcd
+};
+
+// Map a coordinate outside [0; length) to the coordinate of the pixel it is replaced with.
+// Returns -1 for PAD_CONSTANT, as the pixel is not inside the image
+int borderIndex(int i, const int length, const BorderMode mode);
+
+// Copy of an image, which is extended on all sides according to a border mode.
+// Neighbourhood operations can then read outside the image without any bounds checking, so the inner loops are branch-free.
+// The memory is kept between frames and is only reallocated if the padded image grows beyond the capacity, just like ImageBuffer
+class PaddedImage {
+public:
+    PaddedImage(void) :
+        width(0),
+        height(0),
+        top(0),
+        left(0) {
+    }
+
+    // Add 'top' and 'bottom' rows above and below the image and 'left' and 'right' columns to each side
+    void pad(const Mat *image, const uint16_t _top, const uint16_t bottom, const uint16_t _left, const uint16_t right, const BorderMode mode, const double value = 0);
+
+    // Add n rows above and below and m columns to each side, which is what a (2n + 1) x (2m + 1) kernel needs
+    void pad(const Mat *image, const uint16_t n, const uint16_t m, const BorderMode mode, const double value = 0) {
+        pad(image, n, n, m, m, mode, value);
+    }
+
+    // Pointer to pixel (x, y) of the original image. The coordinates can be outside the image by up to the size of the border
+    template <typename T>
+    inline const T *ptr(const int x, const int y) const {
+        return (const T*)&buffer.data[((y + top) * (size_t)buffer.size().width + x + left) * buffer.elemSize()];
+    }
+
+    inline const uchar *ptr(const int x, const int y) const {
+        return ptr<uchar>(x, y);
+    }
+
+    // Number of elements between two rows, i.e. the padded width times the number of channels
+    size_t getStride(void) const {
+        return buffer.size().width * buffer.channels();
+    }
+
+    // Size of the original image
+    Size size(void) const {
+        return Size(width, height);
+    }
+
+    const Mat *getMat(void) const {
+        return &buffer;
+    }
+
+private:
+    Mat storage, buffer;
+    int width, height;
+    uint16_t top, left;
+};
+
+#endif
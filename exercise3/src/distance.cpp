@@ -0,0 +1,234 @@
+/* Copyright (C) 2015 Kristian Sloth Lauszus. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Sloth Lauszus
+ Web      :  http://www.lauszus.com
+ e-mail   :  lauszus@gmail.com
+*/
+
+#include <opencv2/core.hpp>
+
+#include "distance.h"
+#include "threadpool.h"
+
+using namespace cv;
+
+static const int32_t infiniteDistance = INT32_MAX;
+
+// Arguments passed to the band functions of the Euclidean distance transform
+typedef struct {
+    const Mat *image;
+    int32_t *squaredDistance; // Squared distance of every pixel
+    bool whitePixels;
+} euclidean_distance_band_t;
+
+// The distance to the nearest feature pixel in the same column, i.e. a black pixel when looking at white pixels.
+// The rows are scanned from the top and then from the bottom, which is exact in one dimension. The band is a range of columns,
+// so the inner loops run along the rows
+static void columnDistanceBand(void *arg, int xStart, int xStop) {
+    const euclidean_distance_band_t *band = (const euclidean_distance_band_t*)arg;
+    const Mat *image = band->image;
+    const int width = image->size().width, height = image->size().height;
+    const bool whitePixels = band->whitePixels;
+
+    for (int y = 0; y < height; y++) {
+        const uchar *row = image->ptr(y);
+        int32_t *d = &band->squaredDistance[y * width];
+        const int32_t *above = y > 0 ? &band->squaredDistance[(y - 1) * width] : NULL;
+        for (int x = xStart; x < xStop; x++) {
+            if ((row[x] == 0) == whitePixels) // The pixels the distance is measured to
+                d[x] = 0;
+            else
+                d[x] = above && above[x] != infiniteDistance ? above[x] + 1 : infiniteDistance;
+        }
+    }
+    for (int y = height - 2; y >= 0; y--) {
+        int32_t *d = &band->squaredDistance[y * width];
+        const int32_t *below = &band->squaredDistance[(y + 1) * width];
+        for (int x = xStart; x < xStop; x++) {
+            if (below[x] != infiniteDistance && below[x] + 1 < d[x])
+                d[x] = below[x] + 1;
+        }
+    }
+    for (int y = 0; y < height; y++) {
+        int32_t *d = &band->squaredDistance[y * width];
+        for (int x = xStart; x < xStop; x++) {
+            if (d[x] != infiniteDistance)
+                d[x] *= d[x];
+        }
+    }
+}
+
+// The squared distance along the rows is the lower envelope of the parabolas (x - q)^2 + f(q), where f is the squared distance of the
+// column pass. The parabolas are found in a single scan and the envelope is then evaluated at every pixel. Columns without any feature
+// pixels do not add a parabola
+static void rowDistanceBand(void *arg, int yStart, int yStop) {
+    const euclidean_distance_band_t *band = (const euclidean_distance_band_t*)arg;
+    const int width = band->image->size().width;
+
+    static thread_local std::vector<int32_t> fBuffer, vBuffer;
+    static thread_local std::vector<double> zBuffer;
+    fBuffer.resize(max((size_t)width, fBuffer.size()));
+    vBuffer.resize(max((size_t)width, vBuffer.size()));
+    zBuffer.resize(max((size_t)width + 1, zBuffer.size()));
+    int32_t *f = fBuffer.data(), *v = vBuffer.data(); // Locations of the parabolas in the lower envelope
+    double *z = zBuffer.data(); // Boundaries between the parabolas
+
+    for (int y = yStart; y < yStop; y++) {
+        int32_t *d = &band->squaredDistance[y * width];
+        memcpy(f, d, width * sizeof(int32_t));
+
+        int k = -1; // Index of the rightmost parabola in the envelope
+        for (int q = 0; q < width; q++) {
+            if (f[q] == infiniteDistance)
+                continue;
+            double s = 0;
+            while (k >= 0) {
+                // Intersection between the new parabola and the rightmost one. Both sides are integers, so this is exact enough
+                const int32_t p = v[k];
+                s = ((double)f[q] + (double)q * q - (double)f[p] - (double)p * p) / (2.0 * (q - p));
+                if (s > z[k])
+                    break;
+                k--; // The parabola is hidden by the new one
+            }
+            k++;
+            v[k] = q;
+            z[k] = k == 0 ? -HUGE_VAL : s;
+        }
+
+        if (k < 0) {
+            for (int x = 0; x < width; x++)
+                d[x] = infiniteDistance; // There are no feature pixels in the image
+            continue;
+        }
+
+        z[k + 1] = HUGE_VAL;
+        int j = 0;
+        for (int x = 0; x < width; x++) {
+            while (z[j + 1] < x)
+                j++;
+            d[x] = (x - v[j]) * (x - v[j]) + f[v[j]];
+        }
+    }
+}
+
+// Calculate the squared Euclidean distance into a buffer, which is kept between frames
+static const int32_t *getSquaredDistance(const Mat *image, bool whitePixels) {
+    static thread_local std::vector<int32_t> squaredDistanceBuffer;
+    squaredDistanceBuffer.resize(max(image->total(), squaredDistanceBuffer.size()));
+
+    euclidean_distance_band_t band = { image, squaredDistanceBuffer.data(), whitePixels };
+    ThreadPool::getInstance().run(columnDistanceBand, &band, image->size().width);
+    ThreadPool::getInstance().run(rowDistanceBand, &band, image->size().height);
+    return squaredDistanceBuffer.data();
+}
+
+// Two-pass chamfer distance with a distance of 3 to the horizontal and vertical neighbours and 4 to the diagonal neighbours.
+// Every pixel depends on the pixels before it in the pass, so this is done on a single thread
+static void chamferDistance(const Mat *image, Mat *distance, bool whitePixels) {
+    const int width = image->size().width, height = image->size().height;
+    const float infinite = HUGE_VALF;
+
+    for (int y = 0; y < height; y++) { // Forward pass
+        const uchar *row = image->ptr(y);
+        float *d = distance->ptr<float>(y);
+        const float *above = y > 0 ? distance->ptr<float>(y - 1) : NULL;
+        for (int x = 0; x < width; x++) {
+            if ((row[x] == 0) == whitePixels) {
+                d[x] = 0;
+                continue;
+            }
+            float value = infinite;
+            if (x > 0)
+                value = min(value, d[x - 1] + 3);
+            if (above) {
+                value = min(value, above[x] + 3);
+                if (x > 0)
+                    value = min(value, above[x - 1] + 4);
+                if (x < width - 1)
+                    value = min(value, above[x + 1] + 4);
+            }
+            d[x] = value;
+        }
+    }
+
+    for (int y = height - 1; y >= 0; y--) { // Backward pass
+        float *d = distance->ptr<float>(y);
+        const float *below = y < height - 1 ? distance->ptr<float>(y + 1) : NULL;
+        for (int x = width - 1; x >= 0; x--) {
+            float value = d[x];
+            if (x < width - 1)
+                value = min(value, d[x + 1] + 3);
+            if (below) {
+                value = min(value, below[x] + 3);
+                if (x < width - 1)
+                    value = min(value, below[x + 1] + 4);
+                if (x > 0)
+                    value = min(value, below[x - 1] + 4);
+            }
+            d[x] = value;
+        }
+    }
+
+    for (int y = 0; y < height; y++) {
+        float *d = distance->ptr<float>(y);
+        for (int x = 0; x < width; x++)
+            d[x] /= 3; // Scale the distance to pixels
+    }
+}
+
+void getDistanceMap(const Mat *image, Mat *distance, DistanceType type, bool whitePixels) {
+    assert(image->channels() == 1); // The image must be in black and white
+
+    distance->create(image->size(), CV_32FC1);
+    if (type == DISTANCE_CHAMFER) {
+        chamferDistance(image, distance, whitePixels);
+        return;
+    }
+
+    const int32_t *squaredDistance = getSquaredDistance(image, whitePixels);
+    const int width = image->size().width;
+    for (int y = 0; y < image->size().height; y++) {
+        float *d = distance->ptr<float>(y);
+        for (int x = 0; x < width; x++) {
+            const int32_t s = squaredDistance[y * width + x];
+            d[x] = s == infiniteDistance ? HUGE_VALF : sqrtf(s);
+        }
+    }
+}
+
+Mat distanceMorphologicalFilter(const Mat *image, MorphologicalType type, const uint8_t structuringElementSize, bool whitePixels) {
+    Mat filteredImage;
+    distanceMorphologicalFilter(image, &filteredImage, type, structuringElementSize, whitePixels);
+    return filteredImage;
+}
+
+void distanceMorphologicalFilter(const Mat *image, Mat *filteredImage, MorphologicalType type, const uint8_t structuringElementSize, bool whitePixels) {
+    assert(image->channels() == 1); // The image must be in black and white
+    assert(image->data != filteredImage->data); // The filter can not be applied in-place
+
+    // Dilation of white pixels grows the white pixels, so every pixel within the radius of a white pixel becomes white.
+    // Erosion of white pixels is the same as dilation of the black pixels
+    const bool useMax = (type == DILATION && whitePixels) || (type == EROSION && !whitePixels); // Max is used for dilation when looking for white pixels
+    const int32_t r = (structuringElementSize - 1) / 2; // Radius of StructuringElement::disk
+    const int32_t *squaredDistance = getSquaredDistance(image, !useMax); // Distance to the nearest white pixel when using max
+
+    filteredImage->create(image->size(), image->type());
+    const uchar inside = useMax ? 255 : 0;
+    const int width = image->size().width;
+    for (int y = 0; y < image->size().height; y++) {
+        uchar *out = filteredImage->ptr(y);
+        const int32_t *d = &squaredDistance[y * width];
+        for (int x = 0; x < width; x++)
+            out[x] = d[x] <= r * r ? inside : 255 - inside;
+    }
+}
@@ -0,0 +1,41 @@
+/* Copyright (C) 2015 Kristian Sloth Lauszus. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Sloth Lauszus
+ Web      :  http://www.lauszus.com
+ e-mail   :  lauszus@gmail.com
+*/
+
+#ifndef __distance_h__
+#define __distance_h__
+
+#include "filter.h"
+
+using namespace cv;
+
+enum DistanceType {
+    DISTANCE_CHAMFER = 0, // Two-pass 3-4 chamfer distance, which approximates the Euclidean distance with an octagon
+    DISTANCE_EUCLIDEAN, // Exact Euclidean distance by P. Felzenszwalb and D. Huttenlocher, "Distance Transforms of Sampled Functions", 2012
+};
+
+// Distance from every pixel to the nearest black pixel of a black and white image, where every non-zero pixel is white.
+// If 'whitePixels' is false it is the distance to the nearest white pixel instead. The distance is 0 at the pixels themselves.
+// Pixels outside the image are ignored. The result is written into 'distance' as CV_32FC1
+void getDistanceMap(const Mat *image, Mat *distance, DistanceType type = DISTANCE_EUCLIDEAN, bool whitePixels = true);
+
+// Erosion and dilation of a black and white image with a disk of the same size as StructuringElement::disk. The squared Euclidean distance
+// to the nearest pixel of the other color is thresholded, so the cost does not depend on the size of the disk.
+// The result is the same as morphologicalFilter with a disk and PAD_REPLICATE, as pixels outside the image are ignored
+Mat distanceMorphologicalFilter(const Mat *image, MorphologicalType type, const uint8_t structuringElementSize, bool whitePixels);
+void distanceMorphologicalFilter(const Mat *image, Mat *filteredImage, MorphologicalType type, const uint8_t structuringElementSize, bool whitePixels);
+
+#endif
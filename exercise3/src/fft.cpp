@@ -0,0 +1,73 @@
+/* Copyright (C) 2015 Kristian Sloth Lauszus. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Sloth Lauszus
+ Web      :  http://www.lauszus.com
+ e-mail   :  lauszus@gmail.com
+*/
+
+#include <opencv2/core.hpp>
+
+#include "fft.h"
+
+using namespace cv;
+
+uint16_t nextPowerOfTwo(uint16_t x) {
+    uint16_t n = 1;
+    while (n < x)
+        n <<= 1;
+    return n;
+}
+
+// Iterative Cooley-Tukey FFT. See: https://en.wikipedia.org/wiki/Cooley%E2%80%93Tukey_FFT_algorithm
+void fft(complex_t *data, const uint16_t length, bool inverse) {
+    assert((length & (length - 1)) == 0); // Length has to be a power of two
+
+    // Bit reversal permutation
+    for (uint16_t i = 1, j = 0; i < length; i++) {
+        uint16_t bit = length >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j)
+            std::swap(data[i], data[j]);
+    }
+
+    for (uint32_t len = 2; len <= length; len <<= 1) {
+        const double angle = (inverse ? 2 : -2) * M_PI / len;
+        const std::complex<double> step(cos(angle), sin(angle));
+        std::complex<double> w(1, 0); // Twiddle factors are calculated in double precision, as errors accumulate
+        for (uint32_t j = 0; j < len / 2; j++) {
+            const complex_t wf(w.real(), w.imag());
+            for (uint32_t i = j; i < length; i += len) {
+                const complex_t u = data[i];
+                const complex_t t = wf * data[i + len / 2];
+                data[i] = u + t;
+                data[i + len / 2] = u - t;
+            }
+            w *= step;
+        }
+    }
+}
+
+void fft2D(complex_t *data, const uint16_t size, bool inverse, complex_t *column) {
+    for (uint16_t y = 0; y < size; y++)
+        fft(&data[y * size], size, inverse); // Transform all rows
+
+    for (uint16_t x = 0; x < size; x++) { // Transform all columns
+        for (uint16_t y = 0; y < size; y++)
+            column[y] = data[y * size + x];
+        fft(column, size, inverse);
+        for (uint16_t y = 0; y < size; y++)
+            data[y * size + x] = column[y];
+    }
+}
@@ -0,0 +1,35 @@
+/* Copyright (C) 2015 Kristian Sloth Lauszus. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Sloth Lauszus
+ Web      :  http://www.lauszus.com
+ e-mail   :  lauszus@gmail.com
+*/
+
+#ifndef __fft_h__
+#define __fft_h__
+
+#include <complex>
+
+typedef std::complex<float> complex_t;
+
+// In-place radix-2 FFT. The length has to be a power of two. The inverse transform is not scaled
+void fft(complex_t *data, const uint16_t length, bool inverse);
+
+// In-place 2D FFT of a square buffer, where the size has to be a power of two. The inverse transform is not scaled.
+// The buffer 'column' has to be able to hold one column
+void fft2D(complex_t *data, const uint16_t size, bool inverse, complex_t *column);
+
+// Returns the smallest power of two that is larger than or equal to x
+uint16_t nextPowerOfTwo(uint16_t x);
+
+#endif
@@ -15,12 +15,22 @@
  e-mail   :  lauszus@gmail.com
 */
 
+#include <algorithm>
+
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "binary.h"
 #include "filter.h"
 #include "histogram.h"
 #include "misc.h"
+#include "threadpool.h"
 
 using namespace cv;
 
@@ -33,299 +43,2202 @@ LinearFilter operator * (const float gain, const LinearFilter& filter) {
     return filter * gain;
 }
 
-// Some handy linear filter kernels
-const float LowpassFilter::lowpass[3 * 3] = {
-    1, 1, 1,
-    1, 1, 1,
-    1, 1, 1,
-};
-
-const float HighpassFilter::highpass[3 * 3] = {
-    -1, -1, -1,
-    -1,  8, -1,
-    -1, -1, -1,
-};
-
-const float LaplacianFilter::laplacian[3 * 3] = {
-    0,  1,  0,
-    1, -4,  1,
-    0,  1,  0,
-};
-
-const float LaplacianTriangularFilter::laplacianTriangular[3 * 3] = {
-    1,   0,  1,
-    0,  -4,  0,
-    1,   0,  1,
-};
-
-const float LaplaceGaussianFilter::laplaceGaussian[9 * 9] = {
-    0,  0,  1,   2,    2,   2,  1,  0, 0,
-    0,  1,  5,  10,   12,  10,  5,  1, 0,
-    1,  5, 15,  19,   16,  19, 15,  5, 1,
-    2, 10, 19, -19,  -64, -19, 19, 10, 2,
-    2, 12, 16, -64, -148, -64, 16, 12, 2,
-    2, 10, 19, -19,  -64, -19, 19, 10, 2,
-    1,  5, 15,  19,   16,  19, 15,  5, 1,
-    0,  1,  5,  10,   12,  10,  5,  1, 0,
-    0,  0,  1,   2,    2,   2,  1,  0, 0,
-};
-
-Mat LinearFilter::apply(const Mat *q) {
+// Some handy linear filter kernels. The coefficients are defined in the header, so they can be used at compile time
+constexpr float LowpassFilter::lowpass[3 * 3];
+constexpr float HighpassFilter::highpass[3 * 3];
+constexpr float LaplacianFilter::laplacian[3 * 3];
+constexpr float LaplacianTriangularFilter::laplacianTriangular[3 * 3];
+constexpr float LaplaceGaussianFilter::laplaceGaussian[9 * 9];
+
+// Factorize the kernel into a sum of rank-1 terms using the singular value decomposition, so it can be applied as a horizontal pass followed by a vertical pass
+// The singular vectors are found one at a time using power iteration, after which the term is subtracted from the residual kernel
+void LinearFilter::factorize(void) {
+    delete[] h;
+    delete[] v;
+    h = v = NULL;
+    rank = 0;
+
+    // Only use the separable terms if they are cheaper than applying the kernel directly
+    const uint8_t maxRank = (size - 1) / (rows + columns);
+    if (maxRank == 0)
+        return;
+
+    double residual[size];
+    double maxCoefficient = 0;
+    for (uint16_t i = 0; i < size; i++) {
+        residual[i] = c[i];
+        if (fabs(residual[i]) > maxCoefficient)
+            maxCoefficient = fabs(residual[i]);
+    }
+    if (maxCoefficient == 0)
+        return;
+
+    float hTerms[maxRank * columns], vTerms[maxRank * rows];
+    for (uint8_t r = 0; r < maxRank; r++) {
+        // Use the row with the largest norm as the initial guess
+        double x[columns], y[rows];
+        double maxNorm = 0;
+        for (uint8_t i = 0; i < rows; i++) {
+            double norm = 0;
+            for (uint8_t j = 0; j < columns; j++)
+                norm += residual[i * columns + j] * residual[i * columns + j];
+            if (norm > maxNorm) {
+                maxNorm = norm;
+                for (uint8_t j = 0; j < columns; j++)
+                    x[j] = residual[i * columns + j];
+            }
+        }
+        if (maxNorm == 0)
+            break; // Kernel is already represented exactly
+
+        for (uint8_t iteration = 0; iteration < 100; iteration++) {
+            // y = A * x
+            for (uint8_t i = 0; i < rows; i++) {
+                y[i] = 0;
+                for (uint8_t j = 0; j < columns; j++)
+                    y[i] += residual[i * columns + j] * x[j];
+            }
+
+            // x = A^T * y / |A^T * y|
+            double norm = 0, change = 0;
+            double xNew[columns];
+            for (uint8_t j = 0; j < columns; j++) {
+                xNew[j] = 0;
+                for (uint8_t i = 0; i < rows; i++)
+                    xNew[j] += residual[i * columns + j] * y[i];
+                norm += xNew[j] * xNew[j];
+            }
+            norm = sqrt(norm);
+            if (norm == 0)
+                break;
+            for (uint8_t j = 0; j < columns; j++) {
+                xNew[j] /= norm;
+                change += fabs(xNew[j] - x[j]);
+                x[j] = xNew[j];
+            }
+            if (iteration > 0 && change < 1e-12)
+                break; // Converged
+        }
+
+        // The vertical kernel becomes the singular value multiplied by the left singular vector
+        for (uint8_t i = 0; i < rows; i++) {
+            y[i] = 0;
+            for (uint8_t j = 0; j < columns; j++)
+                y[i] += residual[i * columns + j] * x[j];
+        }
+
+        double maxResidual = 0;
+        for (uint8_t i = 0; i < rows; i++) {
+            for (uint8_t j = 0; j < columns; j++) {
+                residual[i * columns + j] -= y[i] * x[j]; // Subtract term from residual kernel
+                if (fabs(residual[i * columns + j]) > maxResidual)
+                    maxResidual = fabs(residual[i * columns + j]);
+            }
+        }
+
+        for (uint8_t j = 0; j < columns; j++)
+            hTerms[r * columns + j] = x[j];
+        for (uint8_t i = 0; i < rows; i++)
+            vTerms[r * rows + i] = y[i];
+
+        if (maxResidual < 1e-6 * maxCoefficient) { // The terms found so far represent the kernel
+            rank = r + 1;
+            break;
+        }
+    }
+
+    if (rank > 0) {
+        h = new float[rank * columns];
+        v = new float[rank * rows];
+        memcpy(h, hTerms, rank * columns * sizeof(float));
+        memcpy(v, vTerms, rank * rows * sizeof(float));
+    }
+    //printf("Rank: %u\n", rank);
+}
+
+// Convert the kernel into fixed point. The number of fraction bits is chosen, so the largest coefficient just fits in an int16_t,
+// which gives Q1.14 for normalized kernels and down to Q8.8 for kernels with large coefficients
+void LinearFilter::quantize(void) {
+    delete[] cFixed;
+    cFixed = new int16_t[size];
+
+    float maxCoefficient = 0, sumCoefficients = 0;
+    for (uint16_t i = 0; i < size; i++) {
+        sumCoefficients += fabsf(c[i]);
+        if (fabsf(c[i]) > maxCoefficient)
+            maxCoefficient = fabsf(c[i]);
+    }
+
+    fractionBits = 14;
+    while (fractionBits > 0 && maxCoefficient * (1 << fractionBits) > 32767)
+        fractionBits--;
+    assert(maxCoefficient <= 32767); // Kernel can not be represented in fixed point
+    while (fractionBits > 0 && 255.0 * sumCoefficients * (1 << fractionBits) > INT32_MAX)
+        fractionBits--; // Make sure the sum can not overflow the 32-bit accumulator for large kernels
+
+    // As all pixel values are at most 255, the difference between the fixed point and the floating point sum is at most 255 times the total quantization error.
+    // One is added, as the two sums might be truncated to different sides of an integer
+    double error = 0;
+    for (uint16_t i = 0; i < size; i++) {
+        cFixed[i] = lrintf(c[i] * (1 << fractionBits));
+        error += fabs((double)cFixed[i] / (1 << fractionBits) - c[i]);
+    }
+    fixedPointErrorBound = min(255.0, floor(255.0 * error) + 1);
+    //printf("Fraction bits: %u error bound: %u\n", fractionBits, fixedPointErrorBound);
+}
+
+// Store the index and coefficients of all non-zero taps. Zero taps can be skipped, as adding zero does not change the sum
+void LinearFilter::initTaps(void) {
+    delete[] tapIndex;
+    delete[] tapCoefficients;
+    delete[] tapFixedCoefficients;
+    delete[] tapOffsets;
+
+    nTaps = 0;
+    for (uint16_t i = 0; i < size; i++) {
+        if (c[i] != 0)
+            nTaps++;
+    }
+
+    tapIndex = new uint16_t[nTaps];
+    tapCoefficients = new float[nTaps];
+    tapFixedCoefficients = new int16_t[nTaps];
+    tapOffsets = new int32_t[nTaps];
+    tapOffsetsWidth = -1; // Offsets have to be calculated for the first image
+
+    for (uint16_t i = 0, t = 0; i < size; i++) {
+        if (c[i] != 0) {
+            tapIndex[t] = i;
+            tapCoefficients[t] = c[i];
+            tapFixedCoefficients[t++] = cFixed[i];
+        }
+    }
+}
+
+// The offsets into the image only has to be recalculated if the width or number of channels changes
+void LinearFilter::updateTapOffsets(const int width, const uint8_t channels) {
+    if (width == tapOffsetsWidth && channels == tapOffsetsChannels)
+        return;
+    tapOffsetsWidth = width;
+    tapOffsetsChannels = channels;
+
+    for (uint16_t t = 0; t < nTaps; t++) {
+        const int k = tapIndex[t] / columns - n;
+        const int l = tapIndex[t] % columns - m;
+        tapOffsets[t] = (k * width + l) * channels;
+    }
+}
+
+void LinearFilter::apply(const Mat *q, Mat *p) {
+    assert(q->data != p->data); // The filter can not be applied in-place
+    p->create(q->size(), CV_MAKETYPE(outputDepth, q->channels()));
+    if (precision == FIXED_POINT) {
+        applyFixedPoint(q, p); // Apply kernel using integer arithmetic
+        return;
+    }
+
+    uint16_t fftSize;
+    switch (selectMethod(q->size(), &fftSize)) {
+        case CONVOLUTION_FFT:
+            applyFFT(q, p, fftSize); // Multiply with the kernel in the frequency domain
+            break;
+        case CONVOLUTION_SEPARABLE:
+            applySeparable(q, p); // Apply kernel as a horizontal and vertical pass
+            break;
+        default:
+            applyDirect(q, p);
+            break;
+    }
+}
+
+// Convert the response of the filter to the output type. The 8-bit and 16-bit outputs are constrained and truncated,
+// while the floating point output keeps the raw response
+static inline void storeOutput(uchar *dst, const float value) {
+    *dst = constrain(value, 0, 255); // Constrain data into valid range
+}
+
+static inline void storeOutput(int16_t *dst, const float value) {
+    *dst = constrain(value, INT16_MIN, INT16_MAX);
+}
+
+static inline void storeOutput(float *dst, const float value) {
+    *dst = value;
+}
+
+// Fixed point version of storeOutput. For the 8-bit output the sum is shifted down, which rounds towards minus infinity.
+// This is the same as truncating for positive values, while negative values are constrained to zero anyway.
+// The signed output has to be rounded towards zero, so negative values are offset before they are shifted
+static inline void storeFixedPointOutput(uchar *dst, const int32_t value, const uint8_t fractionBits) {
+    *dst = constrain(value >> fractionBits, 0, 255); // Constrain data into valid range
+}
+
+static inline void storeFixedPointOutput(int16_t *dst, const int32_t value, const uint8_t fractionBits) {
+    const int32_t offset = value < 0 ? (1 << fractionBits) - 1 : 0;
+    *dst = constrain((value + offset) >> fractionBits, INT16_MIN, INT16_MAX);
+}
+
+static inline void storeFixedPointOutput(float *dst, const int32_t value, const uint8_t fractionBits) {
+    *dst = (float)value / (1 << fractionBits);
+}
+
+// Convert a row of responses to the output type given by the depth of the output image
+static void storeOutputRow(void *dst, const int depth, const float *src, const size_t length) {
+    switch (depth) {
+        case CV_16S:
+            for (size_t i = 0; i < length; i++)
+                storeOutput(&((int16_t*)dst)[i], src[i]);
+            break;
+        case CV_32F:
+            memcpy(dst, src, length * sizeof(float));
+            break;
+        default:
+            for (size_t i = 0; i < length; i++)
+                storeOutput(&((uchar*)dst)[i], src[i]);
+            break;
+    }
+}
+
+// Store 16 sums as the output type. Only the 8-bit output needs the narrowing and saturation step
+#if defined(__AVX2__)
+static inline void storeOutput16(uchar *dst, const __m256 sum0, const __m256 sum1) {
+    const __m256 low = _mm256_setzero_ps(), high = _mm256_set1_ps(255);
+    const __m256i out0 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(sum0, low), high)); // Constrain and truncate just like the scalar code
+    const __m256i out1 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(sum1, low), high));
+    const __m128i out16_0 = _mm_packs_epi32(_mm256_castsi256_si128(out0), _mm256_extracti128_si256(out0, 1));
+    const __m128i out16_1 = _mm_packs_epi32(_mm256_castsi256_si128(out1), _mm256_extracti128_si256(out1, 1));
+    _mm_storeu_si128((__m128i*)dst, _mm_packus_epi16(out16_0, out16_1));
+}
+
+static inline void storeOutput16(int16_t *dst, const __m256 sum0, const __m256 sum1) {
+    const __m256 low = _mm256_set1_ps(INT16_MIN), high = _mm256_set1_ps(INT16_MAX);
+    const __m256i out0 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(sum0, low), high)); // Constrain and truncate just like the scalar code
+    const __m256i out1 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(sum1, low), high));
+    _mm_storeu_si128((__m128i*)dst, _mm_packs_epi32(_mm256_castsi256_si128(out0), _mm256_extracti128_si256(out0, 1)));
+    _mm_storeu_si128((__m128i*)&dst[8], _mm_packs_epi32(_mm256_castsi256_si128(out1), _mm256_extracti128_si256(out1, 1)));
+}
+
+static inline void storeOutput16(float *dst, const __m256 sum0, const __m256 sum1) {
+    _mm256_storeu_ps(dst, sum0);
+    _mm256_storeu_ps(&dst[8], sum1);
+}
+#elif defined(__SSE2__)
+static inline void storeOutput16(uchar *dst, const __m128 *sum) {
+    __m128i out[4];
+    const __m128 low = _mm_setzero_ps(), high = _mm_set1_ps(255);
+    for (uint8_t j = 0; j < 4; j++)
+        out[j] = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(sum[j], low), high)); // Constrain and truncate just like the scalar code
+    _mm_storeu_si128((__m128i*)dst, _mm_packus_epi16(_mm_packs_epi32(out[0], out[1]), _mm_packs_epi32(out[2], out[3])));
+}
+
+static inline void storeOutput16(int16_t *dst, const __m128 *sum) {
+    __m128i out[4];
+    const __m128 low = _mm_set1_ps(INT16_MIN), high = _mm_set1_ps(INT16_MAX);
+    for (uint8_t j = 0; j < 4; j++)
+        out[j] = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(sum[j], low), high)); // Constrain and truncate just like the scalar code
+    _mm_storeu_si128((__m128i*)dst, _mm_packs_epi32(out[0], out[1]));
+    _mm_storeu_si128((__m128i*)&dst[8], _mm_packs_epi32(out[2], out[3]));
+}
+
+static inline void storeOutput16(float *dst, const __m128 *sum) {
+    for (uint8_t j = 0; j < 4; j++)
+        _mm_storeu_ps(&dst[4 * j], sum[j]);
+}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+static inline void storeOutput16(uchar *dst, const float32x4_t *sum) {
+    uint16x4_t out[4];
+    const float32x4_t low = vdupq_n_f32(0), high = vdupq_n_f32(255);
+    for (uint8_t j = 0; j < 4; j++)
+        out[j] = vmovn_u32(vcvtq_u32_f32(vminq_f32(vmaxq_f32(sum[j], low), high))); // Constrain and truncate just like the scalar code
+    vst1q_u8(dst, vcombine_u8(vmovn_u16(vcombine_u16(out[0], out[1])), vmovn_u16(vcombine_u16(out[2], out[3]))));
+}
+
+static inline void storeOutput16(int16_t *dst, const float32x4_t *sum) {
+    int16x4_t out[4];
+    const float32x4_t low = vdupq_n_f32(INT16_MIN), high = vdupq_n_f32(INT16_MAX);
+    for (uint8_t j = 0; j < 4; j++)
+        out[j] = vmovn_s32(vcvtq_s32_f32(vminq_f32(vmaxq_f32(sum[j], low), high))); // Constrain and truncate just like the scalar code
+    vst1q_s16(dst, vcombine_s16(out[0], out[1]));
+    vst1q_s16(&dst[8], vcombine_s16(out[2], out[3]));
+}
+
+static inline void storeOutput16(float *dst, const float32x4_t *sum) {
+    for (uint8_t j = 0; j < 4; j++)
+        vst1q_f32(&dst[4 * j], sum[j]);
+}
+#endif
+
+// Apply the kernel to a number of consecutive samples of the padded image, so all taps can be read without any bounds checking.
+// The SIMD code accumulates the taps in the same order as the scalar code, so the result is identical.
+// As the channels are interleaved each lane simply processes a single sample, so it works for any number of channels.
+template <typename T>
+static void applyKernelInterior(const uchar *src, T *dst, size_t length, const int32_t *offsets, const float *coefficients, const uint16_t nTaps) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 16 <= length; i += 16) { // 16 samples at a time using two vectors of eight floats
+        __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+        for (uint16_t t = 0; t < nTaps; t++) {
+            const __m128i bytes = _mm_loadu_si128((const __m128i*)&src[i + offsets[t]]);
+            const __m256 value0 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+            const __m256 value1 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(bytes, 8)));
+            const __m256 coefficient = _mm256_set1_ps(coefficients[t]);
+            sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(coefficient, value0)); // Do not use FMA, as it rounds differently
+            sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(coefficient, value1));
+        }
+        storeOutput16(&dst[i], sum0, sum1);
+    }
+#elif defined(__SSE2__)
+    for (; i + 16 <= length; i += 16) { // 16 samples at a time using four vectors of four floats
+        __m128 sum[4] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+        const __m128i zero = _mm_setzero_si128();
+        for (uint16_t t = 0; t < nTaps; t++) {
+            const __m128i bytes = _mm_loadu_si128((const __m128i*)&src[i + offsets[t]]);
+            const __m128i words0 = _mm_unpacklo_epi8(bytes, zero), words1 = _mm_unpackhi_epi8(bytes, zero);
+            const __m128 coefficient = _mm_set1_ps(coefficients[t]);
+            sum[0] = _mm_add_ps(sum[0], _mm_mul_ps(coefficient, _mm_cvtepi32_ps(_mm_unpacklo_epi16(words0, zero))));
+            sum[1] = _mm_add_ps(sum[1], _mm_mul_ps(coefficient, _mm_cvtepi32_ps(_mm_unpackhi_epi16(words0, zero))));
+            sum[2] = _mm_add_ps(sum[2], _mm_mul_ps(coefficient, _mm_cvtepi32_ps(_mm_unpacklo_epi16(words1, zero))));
+            sum[3] = _mm_add_ps(sum[3], _mm_mul_ps(coefficient, _mm_cvtepi32_ps(_mm_unpackhi_epi16(words1, zero))));
+        }
+        storeOutput16(&dst[i], sum);
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; i + 16 <= length; i += 16) { // 16 samples at a time using four vectors of four floats
+        float32x4_t sum[4] = { vdupq_n_f32(0), vdupq_n_f32(0), vdupq_n_f32(0), vdupq_n_f32(0) };
+        for (uint16_t t = 0; t < nTaps; t++) {
+            const uint8x16_t bytes = vld1q_u8(&src[i + offsets[t]]);
+            const uint16x8_t words0 = vmovl_u8(vget_low_u8(bytes)), words1 = vmovl_u8(vget_high_u8(bytes));
+            const float32x4_t coefficient = vdupq_n_f32(coefficients[t]);
+            sum[0] = vaddq_f32(sum[0], vmulq_f32(coefficient, vcvtq_f32_u32(vmovl_u16(vget_low_u16(words0))))); // Do not use vmla/vfma, as the result has to match the scalar code
+            sum[1] = vaddq_f32(sum[1], vmulq_f32(coefficient, vcvtq_f32_u32(vmovl_u16(vget_high_u16(words0)))));
+            sum[2] = vaddq_f32(sum[2], vmulq_f32(coefficient, vcvtq_f32_u32(vmovl_u16(vget_low_u16(words1)))));
+            sum[3] = vaddq_f32(sum[3], vmulq_f32(coefficient, vcvtq_f32_u32(vmovl_u16(vget_high_u16(words1)))));
+        }
+        storeOutput16(&dst[i], sum);
+    }
+#endif
+    for (; i < length; i++) { // Remaining samples
+        float value = 0;
+        for (uint16_t t = 0; t < nTaps; t++)
+            value += coefficients[t] * (float)src[i + offsets[t]];
+        storeOutput(&dst[i], value);
+    }
+}
+
+// Arguments passed to the band functions of LinearFilter
+typedef struct {
+    const LinearFilter *filter;
+    const Mat *q;
+    Mat *p;
+    const PaddedImage *padded;
+    const int32_t *offsets; // Offsets and coefficients of all non-zero taps
+    const void *coefficients;
+    uint16_t nTaps;
+    const float *h, *v; // Current separable term
+    float *tmp, *sum; // Buffers used by the separable passes
+    bool lastTerm;
+} linear_filter_band_t;
+
+// The image is padded, so every row is calculated in one go
+template <typename T>
+static void applyDirectBand(void *arg, int yStart, int yStop) {
+    const linear_filter_band_t *band = (const linear_filter_band_t*)arg;
+    const size_t stride = band->q->size().width * band->q->channels();
+
+    for (int y = yStart; y < yStop; y++)
+        applyKernelInterior(band->padded->ptr(0, y), band->p->ptr<T>(y), stride, band->offsets, (const float*)band->coefficients, band->nTaps);
+}
+
+void LinearFilter::applyDirect(const Mat *q, Mat *p) {
+    assert(q->channels() <= 3);
+    padded.pad(q, n, m, border, borderValue);
+    updateTapOffsets(padded.getMat()->size().width, q->channels());
+
+    linear_filter_band_t band = { this, q, p, &padded, tapOffsets, tapCoefficients, nTaps, NULL, NULL, NULL, NULL, false };
+    ThreadPool::getInstance().run(p->depth() == CV_16S ? applyDirectBand<int16_t> : p->depth() == CV_32F ? applyDirectBand<float> : applyDirectBand<uchar>, &band, q->size().height);
+}
+
+// Store 16 fixed point sums as the output type
+#if defined(__SSE2__)
+static inline void storeFixedPointOutput16(uchar *dst, __m128i *sum, const uint8_t fractionBits) {
+    const __m128i shift = _mm_cvtsi32_si128(fractionBits);
+    for (uint8_t j = 0; j < 4; j++)
+        sum[j] = _mm_sra_epi32(sum[j], shift);
+    // Saturating packs does the constraining into the valid range
+    _mm_storeu_si128((__m128i*)dst, _mm_packus_epi16(_mm_packs_epi32(sum[0], sum[1]), _mm_packs_epi32(sum[2], sum[3])));
+}
+
+static inline void storeFixedPointOutput16(int16_t *dst, __m128i *sum, const uint8_t fractionBits) {
+    const __m128i shift = _mm_cvtsi32_si128(fractionBits), mask = _mm_set1_epi32((1 << fractionBits) - 1);
+    for (uint8_t j = 0; j < 4; j++) {
+        const __m128i offset = _mm_and_si128(_mm_srai_epi32(sum[j], 31), mask); // Round negative values towards zero
+        sum[j] = _mm_sra_epi32(_mm_add_epi32(sum[j], offset), shift);
+    }
+    _mm_storeu_si128((__m128i*)dst, _mm_packs_epi32(sum[0], sum[1]));
+    _mm_storeu_si128((__m128i*)&dst[8], _mm_packs_epi32(sum[2], sum[3]));
+}
+
+static inline void storeFixedPointOutput16(float *dst, __m128i *sum, const uint8_t fractionBits) {
+    const __m128 scale = _mm_set1_ps(1.0f / (1 << fractionBits));
+    for (uint8_t j = 0; j < 4; j++)
+        _mm_storeu_ps(&dst[4 * j], _mm_mul_ps(_mm_cvtepi32_ps(sum[j]), scale));
+}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+static inline void storeFixedPointOutput16(uchar *dst, int32x4_t *sum, const uint8_t fractionBits) {
+    const int32x4_t shift = vdupq_n_s32(-fractionBits); // Shifting left by a negative amount is an arithmetic right shift
+    int16x4_t out[4];
+    for (uint8_t j = 0; j < 4; j++)
+        out[j] = vqmovn_s32(vshlq_s32(sum[j], shift));
+    // Saturating narrowing does the constraining into the valid range
+    vst1q_u8(dst, vcombine_u8(vqmovun_s16(vcombine_s16(out[0], out[1])), vqmovun_s16(vcombine_s16(out[2], out[3]))));
+}
+
+static inline void storeFixedPointOutput16(int16_t *dst, int32x4_t *sum, const uint8_t fractionBits) {
+    const int32x4_t shift = vdupq_n_s32(-fractionBits), mask = vdupq_n_s32((1 << fractionBits) - 1);
+    int16x4_t out[4];
+    for (uint8_t j = 0; j < 4; j++) {
+        const int32x4_t offset = vandq_s32(vshrq_n_s32(sum[j], 31), mask); // Round negative values towards zero
+        out[j] = vqmovn_s32(vshlq_s32(vaddq_s32(sum[j], offset), shift));
+    }
+    vst1q_s16(dst, vcombine_s16(out[0], out[1]));
+    vst1q_s16(&dst[8], vcombine_s16(out[2], out[3]));
+}
+
+static inline void storeFixedPointOutput16(float *dst, int32x4_t *sum, const uint8_t fractionBits) {
+    const float32x4_t scale = vdupq_n_f32(1.0f / (1 << fractionBits));
+    for (uint8_t j = 0; j < 4; j++)
+        vst1q_f32(&dst[4 * j], vmulq_f32(vcvtq_f32_s32(sum[j]), scale));
+}
+#endif
+
+// Fixed point version of applyKernelInterior, where the 16-bit products are accumulated in 32-bits before being converted to the output type
+template <typename T>
+static void applyFixedPointKernelInterior(const uchar *src, T *dst, size_t length, const int32_t *offsets, const int16_t *coefficients, const uint16_t nTaps, const uint8_t fractionBits) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= length; i += 16) { // 16 samples at a time using four vectors of four 32-bit integers
+        __m128i sum[4] = { _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128() };
+        const __m128i zero = _mm_setzero_si128();
+        for (uint16_t t = 0; t < nTaps; t++) {
+            const __m128i bytes = _mm_loadu_si128((const __m128i*)&src[i + offsets[t]]);
+            const __m128i coefficient = _mm_set1_epi16(coefficients[t]);
+            const __m128i words[2] = { _mm_unpacklo_epi8(bytes, zero), _mm_unpackhi_epi8(bytes, zero) };
+            for (uint8_t j = 0; j < 2; j++) {
+                const __m128i low = _mm_mullo_epi16(words[j], coefficient), high = _mm_mulhi_epi16(words[j], coefficient);
+                sum[2 * j] = _mm_add_epi32(sum[2 * j], _mm_unpacklo_epi16(low, high)); // Combine the lower and upper half into 32-bit products
+                sum[2 * j + 1] = _mm_add_epi32(sum[2 * j + 1], _mm_unpackhi_epi16(low, high));
+            }
+        }
+        storeFixedPointOutput16(&dst[i], sum, fractionBits);
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; i + 16 <= length; i += 16) { // 16 samples at a time using four vectors of four 32-bit integers
+        int32x4_t sum[4] = { vdupq_n_s32(0), vdupq_n_s32(0), vdupq_n_s32(0), vdupq_n_s32(0) };
+        for (uint16_t t = 0; t < nTaps; t++) {
+            const uint8x16_t bytes = vld1q_u8(&src[i + offsets[t]]);
+            const int16x8_t words0 = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(bytes)));
+            const int16x8_t words1 = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(bytes)));
+            const int16x4_t coefficient = vdup_n_s16(coefficients[t]);
+            sum[0] = vmlal_s16(sum[0], vget_low_s16(words0), coefficient);
+            sum[1] = vmlal_s16(sum[1], vget_high_s16(words0), coefficient);
+            sum[2] = vmlal_s16(sum[2], vget_low_s16(words1), coefficient);
+            sum[3] = vmlal_s16(sum[3], vget_high_s16(words1), coefficient);
+        }
+        storeFixedPointOutput16(&dst[i], sum, fractionBits);
+    }
+#endif
+    for (; i < length; i++) { // Remaining samples
+        int32_t value = 0;
+        for (uint16_t t = 0; t < nTaps; t++)
+            value += coefficients[t] * src[i + offsets[t]];
+        storeFixedPointOutput(&dst[i], value, fractionBits);
+    }
+}
+
+template <typename T>
+static void applyFixedPointBand(void *arg, int yStart, int yStop) {
+    const linear_filter_band_t *band = (const linear_filter_band_t*)arg;
+    const size_t stride = band->q->size().width * band->q->channels();
+
+    for (int y = yStart; y < yStop; y++)
+        applyFixedPointKernelInterior(band->padded->ptr(0, y), band->p->ptr<T>(y), stride, band->offsets, (const int16_t*)band->coefficients, band->nTaps, band->filter->fractionBits);
+}
+
+void LinearFilter::applyFixedPoint(const Mat *q, Mat *p) {
+    assert(q->channels() <= 3);
+    padded.pad(q, n, m, border, borderValue);
+    updateTapOffsets(padded.getMat()->size().width, q->channels());
+
+    linear_filter_band_t band = { this, q, p, &padded, tapOffsets, tapFixedCoefficients, nTaps, NULL, NULL, NULL, NULL, false };
+    ThreadPool::getInstance().run(p->depth() == CV_16S ? applyFixedPointBand<int16_t> : p->depth() == CV_32F ? applyFixedPointBand<float> : applyFixedPointBand<uchar>, &band, q->size().height);
+}
+
+// Horizontal pass over the rows of the padded image, including the rows above and below the image needed by the vertical pass.
+// The pointers are restricted, so the compiler is able to vectorize the loop
+static void applyHorizontalBand(void *arg, int yStart, int yStop) {
+    const linear_filter_band_t *band = (const linear_filter_band_t*)arg;
+    const int n = band->filter->n, m = band->filter->m;
+    const uint8_t channels = band->q->channels();
+    const size_t stride = band->q->size().width * channels;
+
+    for (int y = yStart; y < yStop; y++) {
+        float * __restrict dst = &band->tmp[y * stride];
+        memset(dst, 0, stride * sizeof(float));
+        for (int l = -m; l <= m; l++) {
+            const uchar * __restrict src = band->padded->ptr(l, y - n);
+            const float gain = band->h[l + m];
+            for (size_t i = 0; i < stride; i++)
+                dst[i] += gain * (float)src[i];
+        }
+    }
+}
+
+// Vertical pass, which is accumulated into the sum of all terms. After the last term the sum is written to the output
+static void applyVerticalBand(void *arg, int yStart, int yStop) {
+    const linear_filter_band_t *band = (const linear_filter_band_t*)arg;
+    const int n = band->filter->n;
+    const size_t stride = band->q->size().width * band->q->channels();
+
+    for (int y = yStart; y < yStop; y++) {
+        float *dst = &band->sum[y * stride];
+        for (int k = -n; k <= n; k++) {
+            const float *src = &band->tmp[(y + k + n) * stride]; // The intermediate result starts n rows above the image
+            const float gain = band->v[k + n];
+            for (size_t i = 0; i < stride; i++)
+                dst[i] += gain * src[i];
+        }
+        if (band->lastTerm)
+            storeOutputRow(band->p->ptr(y), band->p->depth(), dst, stride);
+    }
+}
+
+void LinearFilter::applySeparable(const Mat *q, Mat *p) {
     const Size size = q->size();
-    const int width = size.width;
     const int height = size.height;
     const uint8_t channels = q->channels();
-    const size_t nPixels = q->total() * channels;
-
-    Mat p(size, q->type());
-
-    size_t index = 0;
-    for (size_t y = 0; y < height; y++) {
-        for (size_t x = 0; x < width; x++) {
-            float value[3] = { 0, 0, 0 };
-            for (int8_t k = -n; k <= n; k++) {
-                // Make sure that we are within the height limit
-                if ((int32_t)(y + k) < 0)
-                    k = -y;
-                else if (y + k >= height)
-                    break;
-
-                for (int8_t l = -m; l <= m; l++) {
-                    // Make sure that we are within the width limit
-                    if ((int32_t)(x + l) < 0)
-                        l = -x;
-                    else if (x + l >= width)
-                        break;
-
-                    int32_t subIndex = index + (k * width + l) * channels;
-                    bool overflow = subIndex <  0 || subIndex >= nPixels;
-                    if (!overflow) {
-                        for (uint8_t i = 0; i < channels; i++)
-                            value[i] += c[rows * (k + n) + (l + m)] * (float)q->data[subIndex + i];
-                    } else
-                        printf("\nsubIndex: %d\n", subIndex);
-                    assert(!overflow); // Prevent overflow
+
+    padded.pad(q, n, m, border, borderValue);
+    tmp.create(Size(size.width, height + 2 * n), CV_MAKETYPE(CV_32F, channels)); // Intermediate result of the horizontal pass
+    sum.create(size, CV_MAKETYPE(CV_32F, channels)); // Sum of all the terms
+    memset(sum.data, 0, q->total() * channels * sizeof(float));
+
+    linear_filter_band_t band = { this, q, p, &padded, NULL, NULL, 0, NULL, NULL, (float*)tmp.data, (float*)sum.data, false }; // The term is set below
+
+    // The vertical pass needs the rows above and below each band, so all bands of the horizontal pass have to be done first
+    ThreadPool& threadPool = ThreadPool::getInstance();
+    for (uint8_t r = 0; r < rank; r++) {
+        band.h = &h[r * columns];
+        band.v = &v[r * rows];
+        band.lastTerm = r == rank - 1;
+        threadPool.run(applyHorizontalBand, &band, height + 2 * n);
+        threadPool.run(applyVerticalBand, &band, height);
+    }
+}
+
+// Largest FFT used for the tiles. A larger size only reduces the overlap between the tiles slightly, while it does not fit in the cache
+static const uint16_t maxFFTSize = 1024;
+
+// Measured on a x86 desktop. The defaults are fixed, so the same filter always selects the same method
+float LinearFilter::separableCost = 1.5f;
+float LinearFilter::fftCost = 15.0f;
+
+// Calculate the spectrum of the kernel for the given FFT size. The kernel is mirrored, as the filter is a correlation and not a convolution.
+// The scaling of the inverse transform is included in the spectrum
+void LinearFilter::updateSpectrum(const uint16_t fftSize) {
+    if (spectrum != NULL && spectrumSize == fftSize)
+        return; // Already calculated
+    delete[] spectrum;
+    spectrumSize = fftSize;
+
+    const uint32_t length = (uint32_t)fftSize * fftSize;
+    spectrum = new complex_t[length](); // Zero padded
+    for (int k = -n; k <= n; k++) {
+        for (int l = -m; l <= m; l++) {
+            const uint16_t y = (fftSize - k) % fftSize, x = (fftSize - l) % fftSize;
+            spectrum[y * fftSize + x] = c[columns * (k + n) + (l + m)] / (float)length;
+        }
+    }
+
+    complex_t *column = new complex_t[fftSize];
+    fft2D(spectrum, fftSize, false, column);
+    delete[] column;
+}
+
+// Arguments passed to the band functions of the FFT convolution
+typedef struct {
+    const LinearFilter *filter;
+    const Mat *q; // The padded image
+    Mat *p;
+    float *sum; // The tiles are added to this buffer, which has the same size as the padded image
+    uint16_t fftSize, tileWidth, tileHeight;
+    uint8_t parity; // Only tile rows with this parity are processed
+} fft_filter_band_t;
+
+// Overlap-add: each tile is zero padded, so the circular convolution of the tile is the same as the linear convolution.
+// The result of every tile is then added to the output, where it overlaps with the neighbouring tiles by the size of the kernel.
+// The image is real, so two tiles are packed into the real and imaginary part and transformed at once. This works as the kernel is real as well
+static void applyFFTBand(void *arg, int yStart, int yStop) {
+    const fft_filter_band_t *band = (const fft_filter_band_t*)arg;
+    const LinearFilter *filter = band->filter;
+    const int n = filter->n, m = filter->m;
+    const Mat *q = band->q;
+    const int width = q->size().width;
+    const int height = q->size().height;
+    const uint8_t channels = q->channels();
+    const uint16_t fftSize = band->fftSize, tileWidth = band->tileWidth, tileHeight = band->tileHeight;
+    const uint32_t length = (uint32_t)fftSize * fftSize;
+
+    const int tilesX = (width + tileWidth - 1) / tileWidth;
+    const int nTiles = tilesX * channels; // Number of tiles in every tile row
+
+    // Every thread keeps its buffers, so they are only allocated the first time or if the FFT size increases
+    static thread_local std::vector<complex_t> dataBuffer, columnBuffer;
+    dataBuffer.resize(max((size_t)length, dataBuffer.size()));
+    columnBuffer.resize(max((size_t)fftSize, columnBuffer.size()));
+    complex_t *data = dataBuffer.data();
+    complex_t *column = columnBuffer.data();
+    float *samples = (float*)data; // Real and imaginary parts are interleaved
+
+    // Process the tile rows starting inside the band
+    for (int ty = (yStart + tileHeight - 1) / tileHeight; ty * tileHeight < yStop; ty++) {
+        if (ty % 2 != band->parity)
+            continue;
+        const int y0 = ty * tileHeight;
+        const int tileRows = min((int)tileHeight, height - y0);
+
+        for (int tile = 0; tile < nTiles; tile += 2) {
+            const uint8_t tiles = min(2, nTiles - tile);
+            std::fill(data, data + length, complex_t(0, 0));
+            for (uint8_t j = 0; j < tiles; j++) {
+                const int x0 = (tile + j) / channels * tileWidth;
+                const uint8_t i = (tile + j) % channels;
+                const int tileColumns = min((int)tileWidth, width - x0);
+                for (int y = 0; y < tileRows; y++) {
+                    const uchar *src = &q->data[((y0 + y) * width + x0) * channels + i];
+                    for (int x = 0; x < tileColumns; x++)
+                        samples[2 * (y * fftSize + x) + j] = src[x * channels];
+                }
+            }
+
+            fft2D(data, fftSize, false, column);
+            for (uint32_t k = 0; k < length; k++)
+                data[k] *= filter->spectrum[k];
+            fft2D(data, fftSize, true, column);
+
+            for (uint8_t j = 0; j < tiles; j++) {
+                const int x0 = (tile + j) / channels * tileWidth;
+                const uint8_t i = (tile + j) % channels;
+                const int tileColumns = min((int)tileWidth, width - x0);
+                const int kStart = max(-n, -y0), kStop = min(tileRows - 1 + n, height - 1 - y0);
+                const int lStart = max(-m, -x0), lStop = min(tileColumns - 1 + m, width - 1 - x0);
+                for (int y = kStart; y <= kStop; y++) {
+                    float *dst = &band->sum[((y0 + y) * width + x0) * channels + i];
+                    const float *src = &samples[2 * ((y + fftSize) % fftSize) * fftSize + j];
+                    for (int x = lStart; x <= lStop; x++)
+                        dst[x * channels] += src[2 * ((x + fftSize) % fftSize)];
                 }
             }
-            for (uint8_t i = 0; i < channels; i++)
-                p.data[index + i] = constrain(value[i], 0, 255); // Constrain data into valid range
-            index += channels; // Increment with number of channels. Same as: index = (x + y * width) * channels;
+        }
+    }
+}
+
+// Only the part of the sum corresponding to the original image is written to the output
+static void convertFFTBand(void *arg, int yStart, int yStop) {
+    const fft_filter_band_t *band = (const fft_filter_band_t*)arg;
+    const int n = band->filter->n, m = band->filter->m;
+    const uint8_t channels = band->q->channels();
+    const size_t paddedStride = band->q->size().width * channels;
+    const size_t stride = band->p->size().width * channels;
+
+    for (int y = yStart; y < yStop; y++)
+        storeOutputRow(band->p->ptr(y), band->p->depth(), &band->sum[(y + n) * paddedStride + m * channels], stride);
+}
+
+void LinearFilter::applyFFT(const Mat *q, Mat *p, const uint16_t fftSize) {
+    assert(fftSize >= 2 * max(rows, columns)); // The tiles has to be larger than the kernel
+    updateSpectrum(fftSize);
+
+    // The padded image is convolved, so the border is handled just like in the spatial domain
+    padded.pad(q, n, m, border, borderValue);
+    const Mat *image = padded.getMat();
+    const uint8_t channels = q->channels();
+    sum.create(image->size(), CV_MAKETYPE(CV_32F, channels));
+    memset(sum.data, 0, image->total() * channels * sizeof(float));
+
+    fft_filter_band_t band = { this, image, p, (float*)sum.data, fftSize, (uint16_t)(fftSize - columns + 1), (uint16_t)(fftSize - rows + 1), 0 };
+
+    // The tiles overlap with the tile rows above and below, so first every second tile row is processed and then the rest
+    ThreadPool& threadPool = ThreadPool::getInstance();
+    for (band.parity = 0; band.parity < 2; band.parity++)
+        threadPool.run(applyFFTBand, &band, image->size().height);
+    threadPool.run(convertFFTBand, &band, q->size().height);
+}
+
+// Number of butterflies and multiplications per output sample, when the image is split into tiles that fit into the given FFT size
+static float fftOperations(const Size imageSize, const uint16_t fftSize, const uint8_t rows, const uint8_t columns) {
+    const int tileWidth = fftSize - columns + 1, tileHeight = fftSize - rows + 1;
+    const int tiles = ((imageSize.width + tileWidth - 1) / tileWidth) * ((imageSize.height + tileHeight - 1) / tileHeight);
+    const float length = (float)fftSize * fftSize;
+    return tiles * (length * log2f(length) + 0.5f * length) / ((float)imageSize.width * imageSize.height); // Two tiles share a forward and inverse transform
+}
+
+ConvolutionMethod LinearFilter::selectMethod(const Size imageSize, uint16_t *fftSize, float *cost) const {
+    // Find the FFT size with the fewest operations. Small tiles overlap a lot, while large tiles are more expensive per sample
+    uint16_t bestSize = 0;
+    float fftOperationsPerSample = INFINITY;
+    if (method == CONVOLUTION_AUTO || method == CONVOLUTION_FFT || cost) {
+        for (uint32_t size = nextPowerOfTwo(2 * max(rows, columns)); size <= maxFFTSize; size <<= 1) {
+            const float operations = fftOperations(imageSize, size, rows, columns);
+            if (operations < fftOperationsPerSample) {
+                fftOperationsPerSample = operations;
+                bestSize = size;
+            }
+            if ((int)size >= imageSize.width + columns && (int)size >= imageSize.height + rows) // The size is at most maxFFTSize
+                break; // The whole image fits in a single tile
+        }
+    }
+    if (fftSize)
+        *fftSize = bestSize;
+
+    ConvolutionMethod selected = method;
+    if (method == CONVOLUTION_FFT && bestSize == 0)
+        selected = CONVOLUTION_DIRECT; // Fall back to the direct method if the kernel is too large
+    else if (method == CONVOLUTION_SEPARABLE && rank == 0)
+        selected = CONVOLUTION_DIRECT; // Fall back to the direct method if the kernel is not separable
+    if (selected != CONVOLUTION_AUTO && cost == NULL)
+        return selected;
+
+    float costs[4];
+    costs[CONVOLUTION_AUTO] = INFINITY;
+    costs[CONVOLUTION_DIRECT] = nTaps;
+    costs[CONVOLUTION_SEPARABLE] = rank > 0 ? separableCost * rank * (rows + columns) : INFINITY;
+    costs[CONVOLUTION_FFT] = bestSize > 0 ? fftCost * fftOperationsPerSample : INFINITY;
+    //printf("Direct: %f separable: %f FFT: %f (%u)\n", costs[CONVOLUTION_DIRECT], costs[CONVOLUTION_SEPARABLE], costs[CONVOLUTION_FFT], bestSize);
+
+    if (selected == CONVOLUTION_AUTO) {
+        if (costs[CONVOLUTION_FFT] < costs[CONVOLUTION_DIRECT] && costs[CONVOLUTION_FFT] < costs[CONVOLUTION_SEPARABLE])
+            selected = CONVOLUTION_FFT;
+        else if (costs[CONVOLUTION_SEPARABLE] < costs[CONVOLUTION_DIRECT])
+            selected = CONVOLUTION_SEPARABLE;
+        else
+            selected = CONVOLUTION_DIRECT;
+    }
+    if (cost)
+        *cost = costs[selected];
+    return selected;
+}
+
+// Time the three methods using a Gaussian kernel, as it can be applied using all of them. The best of a few runs is used to reduce the noise
+void LinearFilter::calibrate(void) {
+    static const uint8_t n = 7, runs = 3;
+    const Size imageSize(256, 256);
+    const uint16_t fftSize = 64;
+
+    float coefficients[(2 * n + 1) * (2 * n + 1)];
+    for (int k = -n; k <= n; k++) {
+        for (int l = -n; l <= n; l++)
+            coefficients[(k + n) * (2 * n + 1) + (l + n)] = expf(-(k * k + l * l) / (2.0f * 3.0f * 3.0f));
+    }
+    LinearFilter filter(coefficients, n, n);
+
+    Mat q(imageSize, CV_8UC1), p(imageSize, CV_8UC1);
+    for (size_t i = 0; i < q.total(); i++)
+        q.data[i] = rand();
+
+    double time[3] = { INFINITY, INFINITY, INFINITY };
+    for (uint8_t run = 0; run < runs; run++) {
+        for (uint8_t i = 0; i < 3; i++) {
+            const double timer = (double)getTickCount();
+            if (i == 0)
+                filter.applyDirect(&q, &p);
+            else if (i == 1)
+                filter.applySeparable(&q, &p);
+            else
+                filter.applyFFT(&q, &p, fftSize);
+            time[i] = min(time[i], (double)getTickCount() - timer);
         }
     }
 
-    return p;
+    const double samples = q.total();
+    const double tapTime = time[0] / (samples * filter.nTaps);
+    separableCost = time[1] / (samples * filter.rank * (filter.rows + filter.columns)) / tapTime;
+    fftCost = time[2] / (samples * fftOperations(imageSize, fftSize, filter.rows, filter.columns)) / tapTime;
+    //printf("Separable cost: %f FFT cost: %f\n", separableCost, fftCost);
+}
+
+// Calculate the kernel that is equivalent to applying the two filters one after another, which is the convolution of the two kernels.
+// The output has to be able to hold (rows1 + rows2 - 1) * (columns1 + columns2 - 1) coefficients
+static void convolveKernels(const LinearFilter& filter1, const LinearFilter& filter2, float *c) {
+    const uint16_t columns = filter1.columns + filter2.columns - 1;
+    memset(c, 0, (filter1.rows + filter2.rows - 1) * columns * sizeof(float));
+
+    for (uint8_t i1 = 0; i1 < filter1.rows; i1++) {
+        for (uint8_t j1 = 0; j1 < filter1.columns; j1++) {
+            const float c1 = filter1.c[i1 * filter1.columns + j1];
+            if (c1 == 0)
+                continue;
+            for (uint8_t i2 = 0; i2 < filter2.rows; i2++) {
+                for (uint8_t j2 = 0; j2 < filter2.columns; j2++)
+                    c[(i1 + i2) * columns + (j1 + j2)] += c1 * filter2.c[i2 * filter2.columns + j2];
+            }
+        }
+    }
 }
 
 LinearFilter LinearFilter::combineFilterKernels(const LinearFilter filter1, const LinearFilter filter2) {
-    // TODO: Can this be fixed by just using max row or just pad smallest kernel?
-    assert(filter1.size == filter2.size); // Has to be equal sizes for now
-
-    const uint8_t size1 = filter1.size;
-    const uint8_t size2 = filter2.size;
-    const uint8_t rows1 = sqrtf(size1);
-    const uint8_t rows2 = sqrtf(size2);
-    const uint8_t outRow =  rows1 + rows2 - 1;
-    const uint8_t outSize = outRow * outRow;
-
-    float c[outSize];
-    for (uint8_t y = 0; y < outRow; y++) {
-        for (uint8_t x = 0; x < outRow; x++) {
-            size_t index = x + y * outRow;
-            float total = 0;
-
-            const uint8_t startI = max(0, y - rows1 + 1);
-            const uint8_t stopI = min((uint8_t)(y + 1), rows1);
-
-            const uint8_t startJ = max(0, x - rows1 + 1);
-            const uint8_t stopJ = min((uint8_t)(x + 1), rows1);
-
-            for (uint8_t i = startI; i < stopI; i++) {
-                for (uint8_t j = startJ; j < stopJ; j++) {
-                    uint8_t subIndex1 = i * rows1 + j;
-                    uint8_t subIndex2 = (size2 - 1) - x - y * rows2 + (j + i * rows2);
-                    total += filter1.c[subIndex1] * filter2.c[subIndex2];
-                    //printf("Index: %lu %u %u\n", index, subIndex1, subIndex2);
-                }
+    assert(filter1.n + filter2.n <= 127 && filter1.m + filter2.m <= 127); // The combined kernel can be at most 255x255
+
+    float c[(filter1.rows + filter2.rows - 1) * (filter1.columns + filter2.columns - 1)];
+    convolveKernels(filter1, filter2, c);
+    return LinearFilter(c, filter1.n + filter2.n, filter1.m + filter2.m); // Return new filter
+}
+
+static const float identity[1] = { 1 };
+
+LinearFilterChain::LinearFilterChain(void) :
+    nFilters(0),
+    combined(identity, 0, 0),
+    border(PAD_CONSTANT),
+    borderValue(0),
+    outputDepth(CV_8U) {
+}
+
+LinearFilterChain::LinearFilterChain(const LinearFilter& filter, const float gain) :
+    nFilters(0),
+    combined(identity, 0, 0),
+    border(PAD_CONSTANT),
+    borderValue(0),
+    outputDepth(CV_8U) {
+    add(filter, gain);
+}
+
+LinearFilterChain& LinearFilterChain::add(const LinearFilter& filter, const float gain) {
+    assert(combined.n + filter.n <= 127 && combined.m + filter.m <= 127); // The combined kernel can be at most 255x255
+
+    const LinearFilter scaled = filter * gain;
+    addPasses(scaled);
+    nFilters++;
+
+    float c[(combined.rows + filter.rows - 1) * (combined.columns + filter.columns - 1)];
+    convolveKernels(combined, scaled, c);
+    combined = LinearFilter(c, combined.n + filter.n, combined.m + filter.m, false); // The gains are already included
+    combined.setBorder(border, borderValue);
+    combined.setOutputDepth(outputDepth);
+    return *this;
+}
+
+void LinearFilterChain::addPasses(const LinearFilter& filter) {
+    pass_t pass;
+    pass.n = 0;
+    pass.m = filter.m;
+    if (filter.rank == 1 && filter.rows + filter.columns < filter.nTaps) { // Apply as a horizontal pass followed by a vertical pass
+        for (int l = -filter.m; l <= filter.m; l++) {
+            if (filter.h[l + filter.m] != 0) {
+                pass.coefficients.push_back(filter.h[l + filter.m]);
+                pass.k.push_back(0);
+                pass.l.push_back(l);
             }
-            //printf("\n");
-            c[index] = total;
         }
+        passes.push_back(pass);
+
+        pass = pass_t();
+        pass.n = filter.n;
+        pass.m = 0;
+        for (int k = -filter.n; k <= filter.n; k++) {
+            if (filter.v[k + filter.n] != 0) {
+                pass.coefficients.push_back(filter.v[k + filter.n]);
+                pass.k.push_back(k);
+                pass.l.push_back(0);
+            }
+        }
+        passes.push_back(pass);
+    } else {
+        pass.n = filter.n;
+        for (uint16_t t = 0; t < filter.nTaps; t++) {
+            pass.coefficients.push_back(filter.tapCoefficients[t]);
+            pass.k.push_back(filter.tapIndex[t] / filter.columns - filter.n);
+            pass.l.push_back(filter.tapIndex[t] % filter.columns - filter.m);
+        }
+        passes.push_back(pass);
     }
+}
+
+// Arguments passed to the band function of LinearFilterChain
+typedef struct {
+    const void *src; // Pixel (0, 0) of the input of the pass
+    float *dst; // Pixel (0, 0) of the output of the pass
+    size_t srcStride, dstStride; // Number of elements between two rows
+    Mat *out; // The last pass writes the result to the output image instead
+    const float *coefficients;
+    const int16_t *k, *l;
+    uint16_t nTaps;
+    int x0, y0, width; // The pass is applied to 'width' pixels starting at (x0, y0 + y)
+    uint8_t channels;
+} linear_filter_pass_band_t;
+
+// Correlate all rows in the band with a single pass. The input is padded, so every tap is applied to the whole row.
+// The first pass reads the 8-bit input image, while the rest read the floating point result of the previous pass
+template <typename T>
+static void applyPassBand(void *arg, int yStart, int yStop) {
+    const linear_filter_pass_band_t *band = (const linear_filter_pass_band_t*)arg;
+    const size_t stride = band->width * band->channels;
+    static thread_local std::vector<float> rowBuffer; // Used by the last pass. Kept between frames
+    rowBuffer.resize(max(band->out ? stride : 0, rowBuffer.size()));
 
-    return LinearFilter(c, outSize); // Return new filter
+    for (int y = band->y0 + yStart; y < band->y0 + yStop; y++) {
+        float *dst = band->out ? rowBuffer.data() : &band->dst[y * (ptrdiff_t)band->dstStride + band->x0 * band->channels];
+        memset(dst, 0, stride * sizeof(float));
+        for (uint16_t t = 0; t < band->nTaps; t++) {
+            const float coefficient = band->coefficients[t];
+            // The pointers are restricted, so the compiler is able to vectorize the loop
+            const T * __restrict src = &((const T*)band->src)[(y + band->k[t]) * (ptrdiff_t)band->srcStride + (band->x0 + band->l[t]) * band->channels];
+            float * __restrict row = dst;
+            for (size_t i = 0; i < stride; i++)
+                row[i] += coefficient * (float)src[i];
+        }
+        if (band->out)
+            storeOutputRow(band->out->ptr(y), band->out->depth(), dst, stride);
+    }
 }
 
-static void addRemoveToFromHistogram(histogram_t *histogram, const Mat *image, bool add) {
-    const Size size = image->size();
-    const int width = size.width;
-    const int height = size.height;
-    const uint8_t channels = image->channels();
+void LinearFilterChain::apply(const Mat *q, Mat *p) {
+    if (isCombined(q->size()))
+        combined.apply(q, p);
+    else
+        applySeparate(q, p);
+}
+
+void LinearFilterChain::applySeparate(const Mat *q, Mat *p) {
+    assert(q->data != p->data); // The filter can not be applied in-place
+    p->create(q->size(), CV_MAKETYPE(outputDepth, q->channels()));
+    const Size size = q->size();
+    const uint8_t channels = q->channels();
+
+    // The input is only padded once by the size of the combined kernel. Every pass is then applied to the image extended by the
+    // size of the passes after it, so the last pass ends up at the size of the image, just like the combined kernel
+    const int n = combined.n, m = combined.m;
+    padded.pad(q, n, m, border, borderValue);
+    const Size paddedSize(size.width + 2 * m, size.height + 2 * n);
+    const size_t paddedStride = paddedSize.width * channels;
+    for (uint8_t i = 0; i < 2; i++)
+        buffers[i].create(paddedSize, CV_MAKETYPE(CV_32F, channels));
+
+    linear_filter_pass_band_t band;
+    band.channels = channels;
+    band.dstStride = paddedStride;
+
+    ThreadPool& threadPool = ThreadPool::getInstance();
+    int remainingN = n, remainingM = m; // Size of the passes not applied yet
+    for (uint8_t i = 0; i < passes.size(); i++) {
+        remainingN -= passes[i].n;
+        remainingM -= passes[i].m;
+        if (i == 0) {
+            band.src = padded.ptr(0, 0);
+            band.srcStride = padded.getStride();
+        } else {
+            band.src = &((const float*)buffers[(i - 1) % 2].data)[n * paddedStride + m * channels];
+            band.srcStride = paddedStride;
+        }
+        band.dst = &((float*)buffers[i % 2].data)[n * paddedStride + m * channels];
+        band.out = i == passes.size() - 1 ? p : NULL;
+        band.coefficients = passes[i].coefficients.data();
+        band.k = passes[i].k.data();
+        band.l = passes[i].l.data();
+        band.nTaps = passes[i].coefficients.size();
+        band.x0 = -remainingM;
+        band.y0 = -remainingN;
+        band.width = size.width + 2 * remainingM;
+
+        // The rows above and below are needed, so every pass has to be done before the next one is started
+        threadPool.run(i == 0 ? applyPassBand<uchar> : applyPassBand<float>, &band, size.height + 2 * remainingN);
+    }
+    assert(remainingN == 0 && remainingM == 0);
+}
+
+uint32_t LinearFilterChain::numTaps(void) const {
+    uint32_t taps = 0;
+    for (uint8_t i = 0; i < passes.size(); i++)
+        taps += passes[i].coefficients.size();
+    return taps;
+}
+
+float LinearFilterChain::separateCost(void) const {
+    return passCost * passes.size() + tapCost * numTaps();
+}
+
+bool LinearFilterChain::isCombined(const Size imageSize) const {
+    if (passes.size() <= 1)
+        return true; // Nothing to combine
+    float combinedCost;
+    combined.selectMethod(imageSize, NULL, &combinedCost);
+    //printf("Combined: %f separate: %f\n", combinedCost + passCost, separateCost());
+    return combinedCost + passCost <= separateCost();
+}
+
+// Measured on a x86 desktop just like the costs of LinearFilter
+float LinearFilterChain::tapCost = 1.25f;
+float LinearFilterChain::passCost = 3.0f;
+
+// Time a pass with two different number of taps, so the cost of a single tap and the overhead of a pass can be separated.
+// They are compared with a single tap of the direct method of LinearFilter
+void LinearFilterChain::calibrate(void) {
+    static const uint8_t runs = 3;
+    const Size imageSize(256, 256);
+    Mat q(imageSize, CV_8UC1), p(imageSize, CV_8UC1);
+    for (size_t i = 0; i < q.total(); i++)
+        q.data[i] = rand();
+
+    float coefficients[9 * 9];
+    for (uint8_t i = 0; i < 9 * 9; i++)
+        coefficients[i] = 1;
+    LinearFilter filter3(coefficients, 1, 1), filter9(coefficients, 4, 4);
+    filter9.setMethod(CONVOLUTION_DIRECT);
+    LinearFilterChain chain3, chain9;
+    chain3.addPasses(filter3);
+    chain9.addPasses(filter9);
+
+    double time[3] = { INFINITY, INFINITY, INFINITY };
+    for (uint8_t run = 0; run < runs; run++) {
+        for (uint8_t i = 0; i < 3; i++) {
+            const double timer = (double)getTickCount();
+            if (i == 0)
+                chain3.applySeparate(&q, &p);
+            else if (i == 1)
+                chain9.applySeparate(&q, &p);
+            else
+                filter9.apply(&q, &p);
+            time[i] = min(time[i], (double)getTickCount() - timer);
+        }
+    }
+
+    // Both chains use the same number of passes, so the difference is caused by the taps
+    const double samples = q.total();
+    const double directTapTime = time[2] / (samples * filter9.nTaps);
+    const double tapTime = (time[1] - time[0]) / (samples * (chain9.numTaps() - chain3.numTaps()));
+    tapCost = max(tapTime / directTapTime, 0.01);
+    passCost = max((time[0] / samples - chain3.numTaps() * tapTime) / (chain3.passes.size() * directTapTime), 0.0);
+    //printf("Tap cost: %f pass cost: %f\n", tapCost, passCost);
+}
+
+// Arguments passed to the band function of BoxFilter
+typedef struct {
+    const IntegralImage *integral;
+    Mat *p;
+    uint8_t width, height;
+} box_filter_band_t;
 
-    size_t index = 0;
-    for (size_t y = 0; y < height; y++) {
+// Average of the window cropped to the image
+static inline void boxFilterPixel(const box_filter_band_t *band, uchar *dst, const int x, const int y0, const int y1) {
+    const IntegralImage *integral = band->integral;
+    const int x0 = max(0, x - band->width / 2);
+    const int x1 = min(integral->size().width, x - band->width / 2 + band->width);
+    const uint32_t count = (x1 - x0) * (y1 - y0);
+    for (uint8_t i = 0; i < integral->getChannels(); i++)
+        dst[x * integral->getChannels() + i] = integral->sum(x0, y0, x1, y1, i) / count;
+}
+
+static void boxFilterBand(void *arg, int yStart, int yStop) {
+    const box_filter_band_t *band = (const box_filter_band_t*)arg;
+    const IntegralImage *integral = band->integral;
+    const int width = integral->size().width;
+    const int height = integral->size().height;
+    const uint8_t channels = integral->getChannels();
+    const size_t stride = (width + 1) * channels;
+
+    const int left = band->width / 2, right = band->width - left; // The window is [x - left; x + right)
+    const int xStart = min(left, width), xStop = max(xStart, width - right + 1); // Columns where the window is inside the image horizontally
+
+    for (int y = yStart; y < yStop; y++) {
+        // The window is cropped at the border, so only the pixels inside the image are used
+        const int y0 = max(0, y - band->height / 2);
+        const int y1 = min(height, y - band->height / 2 + band->height);
+        uchar *dst = band->p->ptr(y);
+
+        // Left and right border
+        for (int x = 0; x < xStart; x++)
+            boxFilterPixel(band, dst, x, y0, y1);
+        for (int x = xStop; x < width; x++)
+            boxFilterPixel(band, dst, x, y0, y1);
+
+        // In the interior the number of pixels is constant, so the division is replaced by a multiplication.
+        // The fractional part of a non-integer result is at least 1 / count, so the small offset does not change it,
+        // while it makes sure that an exact result is not truncated down due to rounding errors
+        const double scale = 1.0 / (band->width * (y1 - y0));
+        const uint32_t *top = &integral->getData()[y0 * stride], *bottom = &integral->getData()[y1 * stride];
+        const size_t offset = band->width * channels;
+        for (int i = (xStart - left) * channels; i < (xStop - left) * channels; i++) {
+            const uint32_t sum = bottom[i + offset] - bottom[i] - top[i + offset] + top[i];
+            dst[i + left * channels] = sum * scale + 1e-9;
+        }
+    }
+}
+
+void BoxFilter::apply(const IntegralImage *integral, Mat *p) const {
+    p->create(integral->size(), CV_MAKETYPE(CV_8U, integral->getChannels()));
+    box_filter_band_t band = { integral, p, width, height };
+    ThreadPool::getInstance().run(boxFilterBand, &band, integral->size().height);
+}
+
+// Calculate the coefficients from sigma using equation 11b and 8c in the paper by Young and van Vliet
+static recursive_gaussian_t recursiveGaussianCoefficients(const float sigma) {
+    assert(sigma >= 0.5f);
+    const double q = sigma >= 2.5f ? 0.98711 * sigma - 0.96330 : 3.97156 - 4.14554 * sqrt(1 - 0.26891 * sigma);
+    const double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+    const double b1 = 2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q;
+    const double b2 = -(1.4281 * q * q + 1.26661 * q * q * q);
+    const double b3 = 0.422205 * q * q * q;
+
+    recursive_gaussian_t coefficients;
+    coefficients.B = 1 - (b1 + b2 + b3) / b0;
+    coefficients.b1 = b1 / b0;
+    coefficients.b2 = b2 / b0;
+    coefficients.b3 = b3 / b0;
+    return coefficients;
+}
+
+void RecursiveGaussianFilter::init(const float _sigmaX, const float _sigmaY, const uint8_t _orderX, const uint8_t _orderY) {
+    assert(_orderX <= 2 && _orderY <= 2);
+    sigmaX = _sigmaX;
+    sigmaY = _sigmaY;
+    orderX = _orderX;
+    orderY = _orderY;
+    laplacian = false;
+    x = recursiveGaussianCoefficients(sigmaX);
+    y = recursiveGaussianCoefficients(sigmaY);
+}
+
+// Arguments passed to the band functions of RecursiveGaussianFilter
+typedef struct {
+    const RecursiveGaussianFilter *filter;
+    const recursive_gaussian_t *coefficients;
+    const Mat *q;
+    Mat *smoothed, *p;
+    bool laplacian;
+} recursive_gaussian_band_t;
+
+// Causal and anti-causal pass along the rows. The samples before and after the row are set equal to the first and last sample,
+// which is the steady state of the filter for a constant signal
+static void recursiveGaussianHorizontalBand(void *arg, int yStart, int yStop) {
+    const recursive_gaussian_band_t *band = (const recursive_gaussian_band_t*)arg;
+    const recursive_gaussian_t c = *band->coefficients;
+    const int width = band->q->size().width;
+    const uint8_t channels = band->q->channels();
+
+    for (int y = yStart; y < yStop; y++) {
+        const uchar *src = &band->q->data[y * width * channels];
+        float *dst = &((float*)band->smoothed->data)[y * width * channels];
         for (uint8_t i = 0; i < channels; i++) {
-            if (add) {
-                uchar val = image->data[(index + i) + ((width - 1) * channels)]; // Read from the right side of image
-                histogram->data[val][i]++;
-            } else {
-                uchar val = image->data[index + i]; // Read from left side of image
-                if (histogram->data[val][i] > 0)
-                    histogram->data[val][i]--;
-                else {
-                    printf("Size = %dx%d y = %lu i = %u index = %lu\n", width, height, y, i, index);
-                    assert(histogram->data[val][i]); // This should never happen
-                }
+            float w1 = src[i], w2 = w1, w3 = w1;
+            for (int x = 0; x < width; x++) {
+                const float w = c.B * src[x * channels + i] + c.b1 * w1 + c.b2 * w2 + c.b3 * w3;
+                dst[x * channels + i] = w;
+                w3 = w2;
+                w2 = w1;
+                w1 = w;
+            }
+            w1 = w2 = w3 = dst[(width - 1) * channels + i];
+            for (int x = width - 1; x >= 0; x--) {
+                const float w = c.B * dst[x * channels + i] + c.b1 * w1 + c.b2 * w2 + c.b3 * w3;
+                dst[x * channels + i] = w;
+                w3 = w2;
+                w2 = w1;
+                w1 = w;
             }
         }
-        index += width * channels; // Go to next row
     }
 }
 
-Mat fractileFilter(const Mat *image, const uint8_t windowSize, const uint8_t percentile, bool skipBlackPixels) {
-    const Size size = image->size();
-    const int width = size.width;
-    const int height = size.height;
+// Causal and anti-causal pass along the columns. The whole row is processed at a time, so the memory is accessed in order.
+// The band is a range of columns in this case
+static void recursiveGaussianVerticalBand(void *arg, int xStart, int xStop) {
+    const recursive_gaussian_band_t *band = (const recursive_gaussian_band_t*)arg;
+    const recursive_gaussian_t c = *band->coefficients;
+    const int height = band->q->size().height;
+    const size_t stride = band->q->size().width * band->q->channels();
+    float *data = (float*)band->smoothed->data;
+
+    for (int y = 0; y < height; y++) {
+        float * __restrict row = &data[y * stride];
+        const float *row1 = &data[max(y - 1, 0) * stride], *row2 = &data[max(y - 2, 0) * stride], *row3 = &data[max(y - 3, 0) * stride];
+        if (y == 0)
+            continue; // The first row is equal to itself in the steady state
+        for (int i = xStart; i < xStop; i++)
+            row[i] = c.B * row[i] + c.b1 * row1[i] + c.b2 * row2[i] + c.b3 * row3[i];
+    }
+    for (int y = height - 2; y >= 0; y--) {
+        float * __restrict row = &data[y * stride];
+        const float *row1 = &data[min(y + 1, height - 1) * stride], *row2 = &data[min(y + 2, height - 1) * stride], *row3 = &data[min(y + 3, height - 1) * stride];
+        for (int i = xStart; i < xStop; i++)
+            row[i] = c.B * row[i] + c.b1 * row1[i] + c.b2 * row2[i] + c.b3 * row3[i];
+    }
+}
+
+// Central differences of the smoothed image. Pixels outside the image are replaced by the nearest edge pixel
+static float recursiveGaussianDerivative(const float *data, const int width, const int height, const uint8_t channels, const int x, const int y, const uint8_t i, const uint8_t orderX, const uint8_t orderY, bool laplacian) {
+    const float *center = &data[(y * width + x) * channels + i];
+    const int left = x > 0 ? -channels : 0, right = x < width - 1 ? channels : 0;
+    const int up = y > 0 ? -width * channels : 0, down = y < height - 1 ? width * channels : 0;
+
+    if (laplacian)
+        return center[left] + center[right] + center[up] + center[down] - 4 * center[0];
+
+    float value;
+    if (orderX == 0) {
+        if (orderY == 0)
+            return center[0];
+        value = center[0];
+    } else if (orderX == 1)
+        value = 0.5f * (center[right] - center[left]);
+    else
+        value = center[right] - 2 * center[0] + center[left];
+    if (orderY == 0)
+        return value;
+
+    // The vertical derivative of the horizontal derivative
+    const float valueUp = orderX == 0 ? center[up] : orderX == 1 ? 0.5f * (center[up + right] - center[up + left]) : center[up + right] - 2 * center[up] + center[up + left];
+    const float valueDown = orderX == 0 ? center[down] : orderX == 1 ? 0.5f * (center[down + right] - center[down + left]) : center[down + right] - 2 * center[down] + center[down + left];
+    if (orderY == 1)
+        return 0.5f * (valueDown - valueUp);
+    return valueDown - 2 * value + valueUp;
+}
+
+template <typename T>
+static void recursiveGaussianOutputBand(void *arg, int yStart, int yStop) {
+    const recursive_gaussian_band_t *band = (const recursive_gaussian_band_t*)arg;
+    const RecursiveGaussianFilter *filter = band->filter;
+    const int width = band->q->size().width;
+    const int height = band->q->size().height;
+    const uint8_t channels = band->q->channels();
+    const float *data = (const float*)band->smoothed->data;
+
+    for (int y = yStart; y < yStop; y++) {
+        T *dst = band->p->ptr<T>(y); // The output does not have to be continuous
+        for (int x = 0; x < width; x++) {
+            for (uint8_t i = 0; i < channels; i++) {
+                const float value = recursiveGaussianDerivative(data, width, height, channels, x, y, i, filter->orderX, filter->orderY, band->laplacian);
+                const size_t index = x * channels + i;
+                if (sizeof(T) == 1)
+                    dst[index] = constrain(value, 0, 255); // Constrain data into valid range
+                else
+                    dst[index] = value;
+            }
+        }
+    }
+}
+
+void RecursiveGaussianFilter::smooth(const Mat *q) {
+    assert(q->channels() <= 3);
+    const Size size = q->size();
+    smoothed.create(size, CV_MAKETYPE(CV_32F, q->channels()));
+
+    // The vertical pass needs the whole column, so all bands of the horizontal pass have to be done first
+    ThreadPool& threadPool = ThreadPool::getInstance();
+    recursive_gaussian_band_t band = { this, &x, q, &smoothed, NULL, laplacian };
+    threadPool.run(recursiveGaussianHorizontalBand, &band, size.height);
+    band.coefficients = &y;
+    threadPool.run(recursiveGaussianVerticalBand, &band, size.width * q->channels());
+}
+
+void RecursiveGaussianFilter::apply(const Mat *q, Mat *p) {
+    assert(q->data != p->data); // The filter can not be applied in-place
+    smooth(q);
+    p->create(q->size(), q->type());
+    recursive_gaussian_band_t band = { this, NULL, q, &smoothed, p, laplacian };
+    ThreadPool::getInstance().run(recursiveGaussianOutputBand<uchar>, &band, q->size().height);
+}
+
+void RecursiveGaussianFilter::applyFloat(const Mat *q, Mat *p) {
+    smooth(q);
+    p->create(q->size(), CV_MAKETYPE(CV_32F, q->channels()));
+    recursive_gaussian_band_t band = { this, NULL, q, &smoothed, p, laplacian };
+    ThreadPool::getInstance().run(recursiveGaussianOutputBand<float>, &band, q->size().height);
+}
+
+// Arguments passed to the band function of the fractile filter
+typedef struct {
+    const Mat *image;
+    const PaddedImage *padded;
+    Mat *filteredImages; // One output per percentile
+    uint8_t windowSize;
+    const uint8_t *percentiles;
+    uint8_t nPercentiles;
+} fractile_filter_band_t;
+
+// Position of every percentile in the sorted window. At least one pixel, so percentile 0 is the minimum
+static inline void fractilePositions(const fractile_filter_band_t *band, uint32_t *medianPos) {
+    for (uint8_t j = 0; j < band->nPercentiles; j++)
+        medianPos[j] = max(1u, band->windowSize * band->windowSize * band->percentiles[j] / 100u);
+}
+
+// Add or remove a row of the padded image to/from the histograms of all columns
+static inline void addRemoveRowToFromColumnHistograms(two_level_histogram_t *columnHistograms, const uchar *row, const int columns, const uint8_t channels, bool add) {
+    for (uint8_t i = 0; i < channels; i++) {
+        two_level_histogram_t *histograms = &columnHistograms[i * columns];
+        for (int x = 0; x < columns; x++)
+            histograms[x].addRemove(row[x * channels + i], add);
+    }
+}
+
+// Constant time median filter by S. Perreault and P. Hebert, "Median Filtering in Constant Time", 2007 (see ctmf.pdf).
+// Every column of the padded image has a histogram of its windowSize pixels in the rows of the window, which is slid down
+// the image by adding one pixel and removing another. The histogram of the window is slid along the row by adding the histogram
+// of the column entering the window and subtracting the one leaving it, so the cost per pixel is independent of the window size.
+// The histograms have two levels, so the percentile is found by searching 16 coarse bins and then 16 fine bins instead of 256 bins.
+// All percentiles are found from the same histograms, so the cost of sliding the window is shared between them.
+// The column histograms are initialized at the beginning of every band, so each band can be processed independently
+static void fractileFilterBand(void *arg, int yStart, int yStop) {
+    const fractile_filter_band_t *band = (const fractile_filter_band_t*)arg;
+    const Mat *image = band->image;
+    const PaddedImage *padded = band->padded;
+    Mat *filteredImages = band->filteredImages;
+    const uint8_t windowSize = band->windowSize;
+    const uint8_t nPercentiles = band->nPercentiles;
+
+    const int width = image->size().width;
     const uint8_t channels = image->channels();
+    const int columns = width + windowSize - 1; // Width of the padded image
+    const int half = windowSize / 2; // The window is [x - half; x - half + windowSize - 1]
+    uint32_t medianPos[UINT8_MAX];
+    fractilePositions(band, medianPos);
 
-    assert(!skipBlackPixels || (skipBlackPixels && channels == 1)); // If skipping black pixels, then the image must be in black and white
+    // Every thread keeps its buffers, so they are only allocated the first time or if the image gets wider
+    static thread_local std::vector<two_level_histogram_t> columnBuffer, kernelBuffer;
+    columnBuffer.resize(max((size_t)channels * columns, columnBuffer.size()));
+    kernelBuffer.resize(max((size_t)channels, kernelBuffer.size()));
+    two_level_histogram_t *columnHistograms = columnBuffer.data();
+    two_level_histogram_t *kernelHistograms = kernelBuffer.data();
 
-    Mat filteredImage(size, image->type());
-    memset(filteredImage.data, 0, filteredImage.total());
+    // All but the bottom row of the window of the first row in the band
+    for (int i = 0; i < channels * columns; i++)
+        columnHistograms[i].clear();
+    for (int k = 0; k < windowSize - 1; k++)
+        addRemoveRowToFromColumnHistograms(columnHistograms, padded->ptr(-half, yStart - half + k), columns, channels, true);
 
-    // TODO: Just read directly from image instead of copying data to new window
+    uchar *dst[UINT8_MAX]; // Current row of every output image. They do not have to be continuous
+    for (int y = yStart; y < yStop; y++) {
+        for (uint8_t j = 0; j < nPercentiles; j++)
+            dst[j] = filteredImages[j].ptr(y);
+        addRemoveRowToFromColumnHistograms(columnHistograms, padded->ptr(-half, y - half + windowSize - 1), columns, channels, true); // Add the bottom row
 
-    size_t index = 0;
-    histogram_t histogram;
-    for (size_t y = 0; y < height; y++) {
-        for (size_t x = 0; x < width; x++) {
-            // If the picture is only black and white and looking for white pixels, then it is a good idea to set 'skipBlackPixels' to true, as it will save a lot of time!
-            if (skipBlackPixels && image->data[index] == 0) {
-                index += channels;
-                continue;
+        // Build the histogram of the window of the first pixel from its column histograms
+        for (uint8_t i = 0; i < channels; i++) {
+            kernelHistograms[i].clear();
+            for (uint8_t l = 0; l < windowSize; l++)
+                kernelHistograms[i].add(&columnHistograms[i * columns + l]);
+        }
+
+        for (int x = 0; x < width; x++) {
+            // Now find the percentiles from the histogram
+            for (uint8_t j = 0; j < nPercentiles; j++) {
+                for (uint8_t i = 0; i < channels; i++)
+                    dst[j][x * channels + i] = kernelHistograms[i].percentile(medianPos[j]);
             }
 
-            // TODO: Fix problem around border, as it does not go to end position
-            int32_t windowX = x - windowSize / 2;
-            int32_t windowY = y - windowSize / 2;
-
-            uint8_t croppedX = 0, croppedY = 0;
-            if (windowX < 0) {
-                croppedX = -windowX;
-                windowX = 0;
-            } if (windowY < 0) {
-                croppedY = -windowY;
-                windowY = 0;
+            // Slide the window one pixel to the right
+            if (x + windowSize < columns) {
+                for (uint8_t i = 0; i < channels; i++)
+                    kernelHistograms[i].slide(&columnHistograms[i * columns + x + windowSize], &columnHistograms[i * columns + x]);
             }
+        }
 
-            size_t spanX = x + windowSize / 2;
-            size_t spanY = y + windowSize / 2;
+        addRemoveRowToFromColumnHistograms(columnHistograms, padded->ptr(-half, y - half), columns, channels, false); // Remove the top row
+    }
+}
+
+// Bring the histogram of a single column up to date with the window starting at row 'top'. The column histogram holds the window
+// starting at row 'columnTop', so it is slid down by the difference or rebuilt if the windows do not overlap
+static inline void updateColumnHistogram(two_level_histogram_t *histogram, int *columnTop, const PaddedImage *padded, const int x, const int top, const uint8_t windowSize) {
+    if (top - *columnTop >= windowSize) {
+        histogram->clear();
+        for (int k = 0; k < windowSize; k++)
+            histogram->add(*padded->ptr(x, top + k));
+    } else {
+        for (int r = *columnTop; r < top; r++) {
+            histogram->remove(*padded->ptr(x, r));
+            histogram->add(*padded->ptr(x, r + windowSize));
+        }
+    }
+    *columnTop = top;
+}
+
+// Used when skipping black pixels. Instead of sliding every column histogram down every row, the column histograms are only updated
+// when a window that is not skipped needs them, so the rows and columns far away from any non-black pixel are never touched.
+// The cost is proportional to the number of non-black pixels instead of the size of the image, while in a dense image every column
+// is still only slid down once per row
+static void sparseFractileFilterBand(void *arg, int yStart, int yStop) {
+    const fractile_filter_band_t *band = (const fractile_filter_band_t*)arg;
+    const Mat *image = band->image;
+    const PaddedImage *padded = band->padded;
+    Mat *filteredImages = band->filteredImages;
+    const uint8_t windowSize = band->windowSize;
+    const uint8_t nPercentiles = band->nPercentiles;
+
+    const int width = image->size().width;
+    const int columns = width + windowSize - 1; // Width of the padded image
+    const int half = windowSize / 2; // The window is [x - half; x - half + windowSize - 1]
+    uint32_t medianPos[UINT8_MAX];
+    fractilePositions(band, medianPos);
 
-            uint8_t windowWidth = spanX >= width ? windowSize - (spanX - width) - 1: windowSize;
-            uint8_t windowHeight = spanY >= height ? windowSize - (spanY - height) - 1: windowSize;
-            windowWidth -= croppedX;
-            windowHeight -= croppedY;
+    // Every thread keeps its buffers, so they are only allocated the first time or if the image gets wider
+    static thread_local std::vector<two_level_histogram_t> columnBuffer;
+    static thread_local std::vector<int> columnTopBuffer;
+    columnBuffer.resize(max((size_t)columns, columnBuffer.size()));
+    columnTopBuffer.resize(max((size_t)columns, columnTopBuffer.size()));
+    two_level_histogram_t *columnHistograms = columnBuffer.data();
+    int *columnTop = columnTopBuffer.data(); // First row of the window every column histogram holds
+    two_level_histogram_t kernelHistogram;
 
-            //printf("%lu\t%d,%d\t%lu,%lu\t%u,%u\n", index, windowX, windowY, spanX, spanY, windowWidth, windowHeight);
+    // The column histograms are empty at the beginning of every band, so they are rebuilt the first time they are used
+    for (int x = 0; x < columns; x++)
+        columnTop[x] = yStart - half - windowSize;
 
-            // Don't create new window each turn, simply read image directly
-            Mat window = Mat(*image, Rect(windowX, windowY, windowWidth, windowHeight)).clone();
-            /*imshow("Fractile window", window);
-            cvWaitKey(100);*/
+    uchar *dst[UINT8_MAX]; // Current row of every output image. They do not have to be continuous
+    for (int y = yStart; y < yStop; y++) {
+        const uchar *src = image->ptr(y);
+        for (uint8_t j = 0; j < nPercentiles; j++)
+            dst[j] = filteredImages[j].ptr(y);
 
-            // TODO: Fix this hack
-            //static uint32_t counter = 0;
-            if (!skipBlackPixels && windowWidth == windowSize && windowHeight == windowSize) // We have to recalculate the histogram every time if we are skipping pixels
-                addRemoveToFromHistogram(&histogram, &window, true); // Add next side to histogram
-            else {
-                histogram = getHistogram(&window); // Only use this routine the first time
-                //printf("Counter: %d %u %u %u %u\n", ++counter, windowX, windowY, windowWidth, windowHeight);
+        const int top = y - half; // First row of the window
+        bool kernelValid = false; // The kernel histogram is built at the beginning of every run of non-black pixels
+        for (int x = 0; x < width; x++) {
+            // If the picture is only black and white and looking for white pixels, then it is a good idea to set 'skipBlackPixels' to true, as the median is not searched for
+            if (src[x] == 0) {
+                for (uint8_t j = 0; j < nPercentiles; j++)
+                    dst[j][x] = 0;
+                kernelValid = false;
+                continue;
             }
 
-            // Now find median from histogram
-            // TODO: Optimize this
-            const uint32_t medianPos = windowWidth * windowHeight * percentile / 100;
-            uint32_t total[3] = { 0, 0, 0 };
-            int median[3] =  { -1, -1, -1 };
-            for (uint16_t i = 0; i < histogram.nSize; i++) {
-                for (uint8_t j = 0; j < channels; j++) {
-                    //printf("[%d] = %d\n", i, histogram.data[i][j]);
-                    if (median[j] == -1) { // Only run if median is not found yet
-                        total[j] += histogram.data[i][j];
-                        if (total[j] >= medianPos) {
-                            median[j] = i; // Median found
-
-                            bool done = true;
-                            for (uint8_t k = 0; k < channels; k++) {
-                                if (median[k] == -1)
-                                    done = false;
-                            }
-                            if (done) // Break if all medians are found
-                                break;
-                        }
-                    }
+            if (!kernelValid) {
+                // Build the histogram of the window from its column histograms
+                kernelHistogram.clear();
+                for (uint8_t l = 0; l < windowSize; l++) {
+                    updateColumnHistogram(&columnHistograms[x + l], &columnTop[x + l], padded, x + l - half, top, windowSize);
+                    kernelHistogram.add(&columnHistograms[x + l]);
                 }
+                kernelValid = true;
             }
 
-            for (uint8_t i = 0; i < channels; i++) {
-                //printf("Median[%u]: %d at %u\n", i, median[i], medianPos);
-                filteredImage.data[index + i] = median[i];
+            for (uint8_t j = 0; j < nPercentiles; j++)
+                dst[j][x] = kernelHistogram.percentile(medianPos[j]);
+
+            // Slide the window one pixel to the right if the next pixel is not skipped
+            if (x + 1 < width && src[x + 1] != 0) {
+                updateColumnHistogram(&columnHistograms[x + windowSize], &columnTop[x + windowSize], padded, x + windowSize - half, top, windowSize);
+                kernelHistogram.slide(&columnHistograms[x + windowSize], &columnHistograms[x]);
+            }
+        }
+    }
+}
+
+Mat fractileFilter(const Mat *image, const uint8_t windowSize, const uint8_t percentile, bool skipBlackPixels, BorderMode border) {
+    Mat filteredImage;
+    fractileFilter(image, &filteredImage, windowSize, percentile, skipBlackPixels, border);
+    return filteredImage;
+}
+
+void fractileFilter(const Mat *image, Mat *filteredImage, const uint8_t windowSize, const uint8_t percentile, bool skipBlackPixels, BorderMode border) {
+    fractileFilter(image, filteredImage, windowSize, &percentile, 1, skipBlackPixels, border);
+}
+
+void fractileFilter(const Mat *image, Mat *filteredImages, uint8_t windowSize, const uint8_t *percentiles, const uint8_t nPercentiles, bool skipBlackPixels, BorderMode border) {
+    const uint8_t channels = image->channels();
+
+    assert(!skipBlackPixels || (skipBlackPixels && channels == 1)); // If skipping black pixels, then the image must be in black and white
+    windowSize = max(windowSize, (uint8_t)1); // A window size of zero is a single pixel, so a trackbar can go all the way down to zero
+
+    static thread_local PaddedImage padded; // Kept between frames
+    const uint8_t half = windowSize / 2;
+    padded.pad(image, half, windowSize - 1 - half, half, windowSize - 1 - half, border);
+
+    for (uint8_t j = 0; j < nPercentiles; j++) {
+        assert(image->data != filteredImages[j].data); // The filter can not be applied in-place
+        filteredImages[j].create(image->size(), image->type()); // Skipped pixels are set to zero by the band function
+    }
+
+    fractile_filter_band_t band = { image, &padded, filteredImages, windowSize, percentiles, nPercentiles };
+    ThreadPool::getInstance().run(skipBlackPixels ? sparseFractileFilterBand : fractileFilterBand, &band, image->size().height);
+
+    /*histogram_t histogram = getHistogram(filteredImage);
+    imshow("His", drawHistogram(&histogram, filteredImage, Size(600, 400)));*/
+}
+
+// Rows of the padded image packed into bits. The number of white pixels before every word is stored as well, so the number of
+// white pixels before any position in a row is a lookup plus a popcount of the bits in the word. There is always a word after the
+// last pixel, so the position after the last window can be looked up
+typedef struct {
+    const uchar *data;
+    size_t stride;
+    int columns;
+    int words;
+    uint64_t *bits;
+    uint32_t *prefix;
+    uint32_t *rowTotals;
+} binary_rows_t;
+
+static void packBinaryRowsBand(void *arg, int yStart, int yStop) {
+    const binary_rows_t *rows = (const binary_rows_t*)arg;
+    for (int y = yStart; y < yStop; y++) {
+        const uchar *row = &rows->data[y * rows->stride];
+        uint64_t *bits = &rows->bits[y * rows->words];
+        uint32_t *prefix = &rows->prefix[y * rows->words];
+        bits[rows->words - 1] = 0; // Not written by packBinaryRow if the row fits in the other words
+        packBinaryRow(row, rows->columns, bits);
+        uint32_t total = 0;
+        for (int w = 0; w < rows->words; w++) {
+            prefix[w] = total;
+            total += __builtin_popcountll(bits[w]);
+        }
+        rows->rowTotals[y] = total;
+    }
+}
+
+// Number of white pixels in [start; stop) of a packed row
+static inline uint32_t binaryRowCount(const uint64_t *bits, const uint32_t *prefix, const uint32_t start, const uint32_t stop) {
+    const uint32_t before = prefix[start / 64] + __builtin_popcountll(bits[start / 64] & ((1ULL << (start % 64)) - 1));
+    const uint32_t after = prefix[stop / 64] + __builtin_popcountll(bits[stop / 64] & ((1ULL << (stop % 64)) - 1));
+    return after - before;
+}
+
+// Count the white pixels in a row of every window along a packed row of the padded image
+static void binaryWindowRowCounts(const uint64_t *bits, const uint32_t *prefix, const int width, const uint8_t windowSize, uint8_t *counts) {
+    for (int x0 = 0; x0 < width; x0 += 64) {
+        const int n = min(64, width - x0);
+        const int lastWord = (x0 + n - 1 + windowSize) / 64; // Word containing the position after the last window in the block
+        if (prefix[lastWord] + __builtin_popcountll(bits[lastWord]) == prefix[x0 / 64]) {
+            memset(&counts[x0], 0, n); // There are no white pixels in any of the windows
+            continue;
+        }
+        for (int x = x0; x < x0 + n; x++)
+            counts[x] = binaryRowCount(bits, prefix, x, x + windowSize);
+    }
+}
+
+// Arguments passed to the band functions of the binary fractile filter
+typedef struct {
+    const Mat *image;
+    const binary_rows_t *rows;
+    Mat *filteredImage;
+    uint8_t windowSize;
+    int32_t threshold;
+    bool skipBlackPixels;
+} binary_fractile_filter_band_t;
+
+// The number of white pixels in the window of every column is slid down the image by adding the counts of the bottom row and subtracting
+// the counts of the top row. The counts of the last windowSize rows are kept in a ring buffer, so every row is only counted once per band
+static void binaryFractileFilterBand(void *arg, int yStart, int yStop) {
+    const binary_fractile_filter_band_t *band = (const binary_fractile_filter_band_t*)arg;
+    const Mat *image = band->image;
+    const binary_rows_t *rows = band->rows;
+    Mat *filteredImage = band->filteredImage;
+    const uint8_t windowSize = band->windowSize;
+    const int32_t threshold = band->threshold;
+    const bool skipBlackPixels = band->skipBlackPixels;
+
+    const int width = image->size().width;
+
+    // Every thread keeps its buffers, so they are only allocated the first time or if the image gets wider
+    static thread_local std::vector<uint8_t> rowCountBuffer, rowWhiteBuffer;
+    static thread_local std::vector<uint16_t> windowCountBuffer;
+    rowCountBuffer.resize(max((size_t)windowSize * width, rowCountBuffer.size()));
+    rowWhiteBuffer.resize(max((size_t)windowSize, rowWhiteBuffer.size()));
+    windowCountBuffer.resize(max((size_t)width, windowCountBuffer.size()));
+    uint8_t *rowWhite = rowWhiteBuffer.data(); // Set if the row in the ring buffer contains any white pixels
+    uint16_t * __restrict windowCount = windowCountBuffer.data(); // At most 255 x 255 pixels, so 16 bits are enough
+
+    // Row y of the image is row y + windowSize / 2 of the padded image, so the window of row y starts at padded row y
+    memset(windowCount, 0, width * sizeof(uint16_t));
+    for (int k = 0; k < windowSize - 1; k++) { // All but the bottom row of the window of the first row in the band
+        const int r = yStart + k;
+        uint8_t * __restrict counts = &rowCountBuffer[k * width];
+        rowWhite[k] = rows->rowTotals[r] > 0;
+        if (rowWhite[k]) {
+            binaryWindowRowCounts(&rows->bits[r * rows->words], &rows->prefix[r * rows->words], width, windowSize, counts);
+            for (int x = 0; x < width; x++)
+                windowCount[x] += counts[x];
+        }
+    }
+
+    for (int y = yStart; y < yStop; y++) {
+        const int bottom = (y - yStart + windowSize - 1) % windowSize, top = (y - yStart) % windowSize;
+        const int r = y + windowSize - 1;
+        uint8_t * __restrict counts = &rowCountBuffer[bottom * width];
+        rowWhite[bottom] = rows->rowTotals[r] > 0;
+        if (rowWhite[bottom]) { // Add the bottom row
+            binaryWindowRowCounts(&rows->bits[r * rows->words], &rows->prefix[r * rows->words], width, windowSize, counts);
+            for (int x = 0; x < width; x++)
+                windowCount[x] += counts[x];
+        }
+
+        const uchar * __restrict in = image->ptr(y);
+        uchar * __restrict out = filteredImage->ptr(y);
+        if (skipBlackPixels) {
+            for (int x = 0; x < width; x++)
+                out[x] = in[x] && windowCount[x] > threshold ? 255 : 0;
+        } else {
+            for (int x = 0; x < width; x++)
+                out[x] = windowCount[x] > threshold ? 255 : 0;
+        }
+
+        if (rowWhite[top]) { // Remove the top row
+            const uint8_t * __restrict topCounts = &rowCountBuffer[top * width];
+            for (int x = 0; x < width; x++)
+                windowCount[x] -= topCounts[x];
+        }
+    }
+}
+
+// Only the windows of the white pixels are evaluated, which are found by scanning the set bits of the packed rows.
+// The cost is proportional to the number of white pixels times the window size instead of the size of the image
+static void sparseBinaryFractileFilterBand(void *arg, int yStart, int yStop) {
+    const binary_fractile_filter_band_t *band = (const binary_fractile_filter_band_t*)arg;
+    const binary_rows_t *rows = band->rows;
+    Mat *filteredImage = band->filteredImage;
+    const uint8_t windowSize = band->windowSize;
+    const int32_t threshold = band->threshold;
+
+    const int width = band->image->size().width;
+    const int half = windowSize / 2;
+
+    for (int y = yStart; y < yStop; y++) {
+        uchar *out = filteredImage->ptr(y);
+        memset(out, 0, width);
+
+        const int center = y + half; // Row of the pixel in the padded image
+        if (rows->rowTotals[center] == 0)
+            continue;
+
+        const uint64_t *centerBits = &rows->bits[center * rows->words];
+        for (int w = 0; w < rows->words; w++) {
+            uint64_t bits = centerBits[w];
+            while (bits) {
+                const int b = __builtin_ctzll(bits);
+                bits &= bits - 1; // Clear the lowest set bit
+                const int x = w * 64 + b - half; // The window of pixel x starts at column x of the padded image
+                if (x < 0 || x >= width)
+                    continue; // In the border
+                int32_t count = 0;
+                for (int k = 0; k < windowSize; k++) {
+                    const int r = y + k;
+                    count += binaryRowCount(&rows->bits[r * rows->words], &rows->prefix[r * rows->words], x, x + windowSize);
+                }
+                out[x] = count > threshold ? 255 : 0;
             }
-            index += channels;
+        }
+    }
+}
+
+Mat binaryFractileFilter(const Mat *image, const uint8_t windowSize, const uint8_t percentile, bool skipBlackPixels, BorderMode border) {
+    Mat filteredImage;
+    binaryFractileFilter(image, &filteredImage, windowSize, percentile, skipBlackPixels, border);
+    return filteredImage;
+}
+
+void binaryFractileFilter(const Mat *image, Mat *filteredImage, uint8_t windowSize, const uint8_t percentile, bool skipBlackPixels, BorderMode border) {
+    assert(image->channels() == 1); // The image must be in black and white
+    assert(image->data != filteredImage->data); // The filter can not be applied in-place
+    windowSize = max(windowSize, (uint8_t)1); // Same as fractileFilter
+
+    static thread_local PaddedImage padded; // Kept between frames
+    const uint8_t half = windowSize / 2;
+    padded.pad(image, half, windowSize - 1 - half, half, windowSize - 1 - half, border);
+
+    // Pack the padded image into bits. The buffers are kept between frames just like the padded image
+    static thread_local std::vector<uint64_t> bitBuffer;
+    static thread_local std::vector<uint32_t> prefixBuffer, rowTotalBuffer;
+    const int columns = image->size().width + windowSize - 1, paddedHeight = image->size().height + windowSize - 1;
+    const int words = columns / 64 + 1;
+    bitBuffer.resize(max((size_t)words * paddedHeight, bitBuffer.size()));
+    prefixBuffer.resize(max((size_t)words * paddedHeight, prefixBuffer.size()));
+    rowTotalBuffer.resize(max((size_t)paddedHeight, rowTotalBuffer.size()));
+    binary_rows_t rows = { padded.ptr(-half, -half), padded.getStride(), columns, words, bitBuffer.data(), prefixBuffer.data(), rowTotalBuffer.data() };
+    ThreadPool::getInstance().run(packBinaryRowsBand, &rows, paddedHeight);
+
+    filteredImage->create(image->size(), image->type());
+
+    // The percentile is black if at least medianPos pixels are black, so the output is white if there are more white pixels than this
+    const uint32_t medianPos = max(1u, windowSize * windowSize * percentile / 100u); // Percentile 0 is the minimum just like in fractileFilter
+    const int32_t threshold = (int32_t)(windowSize * windowSize) - (int32_t)medianPos;
+    binary_fractile_filter_band_t band = { image, &rows, filteredImage, windowSize, threshold, skipBlackPixels };
+
+    // When skipping black pixels and only a few pixels are white, it is faster to only evaluate the windows of the white pixels.
+    // The sparse version costs about windowSize row counts per white pixel, which breaks even with the dense version at around
+    // one row count per pixel in the image
+    bool sparse = false;
+    if (skipBlackPixels) {
+        uint64_t whitePixels = 0;
+        for (int y = half; y < half + image->size().height; y++)
+            whitePixels += rows.rowTotals[y]; // Includes the left and right border, which is good enough for an estimate
+        sparse = whitePixels * windowSize < image->total();
+    }
+    ThreadPool::getInstance().run(sparse ? sparseBinaryFractileFilterBand : binaryFractileFilterBand, &band, image->size().height);
+}
+
+// Arguments passed to the band functions of the morphological filter
+typedef struct {
+    const PaddedImage *padded;
+    uint8_t *rows; // Result of the horizontal pass. Has height + 2n rows of the width of the image
+    Mat *filteredImage;
+    int n;
+} morphological_filter_band_t;
 
-            if (!skipBlackPixels && windowWidth == windowSize && windowHeight == windowSize)
-                addRemoveToFromHistogram(&histogram, &window, false); // Remove left side of window from histogram
+template<bool useMax>
+static inline uint8_t minMax(const uint8_t a, const uint8_t b) {
+    return useMax ? max(a, b) : min(a, b);
+}
+
+// The erosion and dilation with a rectangle is separable, so it is done as a horizontal pass followed by a vertical pass.
+// Each pass uses the algorithm by M. van Herk, "A fast algorithm for local minimum and maximum filters on rectangular and octagonal kernels", 1992
+// and J. Gil and M. Werman, "Computing 2-D min, median, and max filters", 1993. The line is split into blocks of the size of the window k.
+// The running min/max from the start of every block (g) and from the end of every block (h) is computed, so the window [x; x + k - 1],
+// which spans at most two blocks, is simply the min/max of h[x] and g[x + k - 1]. This is three comparisons per pixel regardless of the size
+template<bool useMax>
+static void vanHerkRow(const uchar *src, uchar *dst, const int width, const int k, uint8_t *g, uint8_t *h) {
+    const int length = width + k - 1; // The source is padded with k - 1 pixels
+    for (int b = 0; b < length; b += k) {
+        const int e = min(b + k, length); // End of the block
+        g[b] = src[b];
+        for (int i = b + 1; i < e; i++)
+            g[i] = minMax<useMax>(g[i - 1], src[i]);
+        h[e - 1] = src[e - 1];
+        for (int i = e - 2; i >= b; i--)
+            h[i] = minMax<useMax>(h[i + 1], src[i]);
+    }
+    for (int x = 0; x < width; x++)
+        dst[x] = minMax<useMax>(h[x], g[x + k - 1]);
+}
+
+// Same as above, but the blocks are rows, so the inner loops run along the rows and can be vectorized.
+// Output row i is the min/max of h[i] and g[i + k - 1]
+template<bool useMax>
+static void vanHerkColumns(const uchar * const *rows, const int length, const int width, const int k, uint8_t * __restrict g, uint8_t * __restrict h) {
+    for (int b = 0; b < length; b += k) {
+        const int e = min(b + k, length); // End of the block
+        memcpy(&g[b * width], rows[b], width);
+        for (int i = b + 1; i < e; i++) {
+            const uchar * __restrict row = rows[i];
+            for (int x = 0; x < width; x++)
+                g[i * width + x] = minMax<useMax>(g[(i - 1) * width + x], row[x]);
+        }
+        memcpy(&h[(e - 1) * width], rows[e - 1], width);
+        for (int i = e - 2; i >= b; i--) {
+            const uchar * __restrict row = rows[i];
+            for (int x = 0; x < width; x++)
+                h[i * width + x] = minMax<useMax>(h[(i + 1) * width + x], row[x]);
         }
     }
+}
+
+template<bool useMax>
+static void morphologicalRowsBand(void *arg, int yStart, int yStop) {
+    const morphological_filter_band_t *band = (const morphological_filter_band_t*)arg;
+    const int width = band->padded->size().width;
+    const int n = band->n, k = 2 * n + 1;
+    const int length = width + 2 * n; // Width of the padded image
 
-    /*histogram_t histogram = getHistogram(&filteredImage);
-    imshow("His", drawHistogram(&histogram, &filteredImage, Size(600, 400)));*/
+    static thread_local std::vector<uint8_t> gBuffer, hBuffer; // Kept between frames
+    gBuffer.resize(max((size_t)length, gBuffer.size()));
+    hBuffer.resize(max((size_t)length, hBuffer.size()));
+
+    for (int r = yStart; r < yStop; r++) // Rows of the padded image
+        vanHerkRow<useMax>(band->padded->ptr(-n, r - n), &band->rows[r * width], width, k, gBuffer.data(), hBuffer.data());
+}
+
+template<bool useMax>
+static void morphologicalColumnsBand(void *arg, int yStart, int yStop) {
+    const morphological_filter_band_t *band = (const morphological_filter_band_t*)arg;
+    const int width = band->padded->size().width;
+    const int n = band->n, k = 2 * n + 1;
+    const int length = yStop - yStart + 2 * n; // The rows of the windows of the band
+
+    static thread_local std::vector<uint8_t> gBuffer, hBuffer; // Kept between frames
+    static thread_local std::vector<const uchar*> rowBuffer;
+    gBuffer.resize(max((size_t)length * width, gBuffer.size()));
+    hBuffer.resize(max((size_t)length * width, hBuffer.size()));
+    rowBuffer.resize(max((size_t)length, rowBuffer.size()));
+    for (int i = 0; i < length; i++)
+        rowBuffer[i] = &band->rows[(yStart + i) * width]; // The window of row y starts at row y of the horizontal pass
+    const uint8_t *g = gBuffer.data(), *h = hBuffer.data();
+    vanHerkColumns<useMax>(rowBuffer.data(), length, width, k, gBuffer.data(), hBuffer.data());
+
+    for (int y = yStart; y < yStop; y++) {
+        const int i = y - yStart;
+        uchar * __restrict dst = band->filteredImage->ptr(y);
+        for (int x = 0; x < width; x++)
+            dst[x] = minMax<useMax>(h[i * width + x], g[(i + k - 1) * width + x]);
+    }
+}
 
+Mat morphologicalFilter(const Mat *image, MorphologicalType type, const uint8_t structuringElementSize, bool whitePixels, BorderMode border) {
+    Mat filteredImage;
+    morphologicalFilter(image, &filteredImage, type, structuringElementSize, whitePixels, border);
     return filteredImage;
 }
 
-// TODO: Optimize this, as this is a very slow approach
-Mat morphologicalFilter(const Mat *image, MorphologicalType type, const uint8_t structuringElementSize, bool whitePixels) {
+void morphologicalFilter(const Mat *image, Mat *filteredImage, MorphologicalType type, const uint8_t structuringElementSize, bool whitePixels, BorderMode border) {
     assert(image->channels() == 1); // Picture must be a greyscale image
+    assert(image->data != filteredImage->data); // The filter can not be applied in-place
 
-    const Size size = image->size();
-    const int width = size.width;
-    const int height = size.height;
     const uint8_t n = (structuringElementSize - 1)/2;
+    filteredImage->create(image->size(), image->type()); // Every pixel is written by the band functions, so there is no need to copy the original image
+    if (n == 0) {
+        image->copyTo(*filteredImage); // The structuring element is a single pixel
+        return;
+    }
 
-    Mat filteredImage = image->clone(); // Create copy of original image
-    size_t index = 0;
-    for (size_t y = 0; y < height; y++) {
-        for (size_t x = 0; x < width; x++) {
-            uint8_t minMax = image->data[index];
-            if ((type == DILATION && whitePixels) || (type == EROSION && !whitePixels)) { // Max is used for dilation when looking for white pixels
-                if (minMax == 255) // It is already the maximum possible value
-                    goto breakout;
-            } else { // Max is used for erosion when looking for white pixels
-                if (minMax == 0) // It is already the minimum possible value
-                    goto breakout;
-            }
-            for (int i = -n; i <= n; i++) { // Look around image
-                for (int j = -n; j <= n; j++) {
-                    size_t subIndex = index + i * width + j;
-                    if (subIndex > 0 && subIndex < width * height && !(i == 0 && j == 0)) { // Prevent overflow and make sure that we are not looking at the center pixel again
-                        if ((type == DILATION && whitePixels) || (type == EROSION && !whitePixels)) { // Max is used for dilation when looking for white pixels
-                            if (image->data[subIndex] > minMax)
-                                minMax = image->data[subIndex]; // Update maximum value
-                            if (minMax == 255)
-                                goto breakout; // Maximum possible value is found
-                        } else { // Max is used for erosion when looking for white pixels
-                            if (image->data[subIndex] < minMax)
-                                minMax = image->data[subIndex]; // Update minimum value
-                            if (minMax == 0)
-                                goto breakout; // Minimum possible value is found
-                        }
-                    }
+    static thread_local PaddedImage padded; // Kept between frames
+    padded.pad(image, n, n, border);
+
+    const int width = image->size().width, height = image->size().height;
+    static thread_local std::vector<uint8_t> rowsBuffer; // Kept between frames
+    rowsBuffer.resize(max((size_t)width * (height + 2 * n), rowsBuffer.size()));
+
+    const bool useMax = (type == DILATION && whitePixels) || (type == EROSION && !whitePixels); // Max is used for dilation when looking for white pixels
+    morphological_filter_band_t band = { &padded, rowsBuffer.data(), filteredImage, n };
+    ThreadPool::getInstance().run(useMax ? morphologicalRowsBand<true> : morphologicalRowsBand<false>, &band, height + 2 * n);
+    ThreadPool::getInstance().run(useMax ? morphologicalColumnsBand<true> : morphologicalColumnsBand<false>, &band, height);
+}
+
+StructuringElement::StructuringElement(const Mat *mask) {
+    assert(mask->channels() == 1);
+    const int width = mask->size().width, height = mask->size().height;
+    const int cx = width / 2, cy = height / 2;
+    top = cy;
+    bottom = height - 1 - cy;
+    left = cx;
+    right = width - 1 - cx;
+
+    for (int y = 0; y < height; y++) {
+        const uchar *row = mask->ptr(y);
+        for (int x = 0; x < width; x++) {
+            if (!row[x])
+                continue;
+            const int start = x;
+            while (x < width && row[x])
+                x++;
+            const uint16_t length = x - start;
+
+            if (std::find(lengths.begin(), lengths.end(), length) == lengths.end())
+                lengths.push_back(length);
+            structuring_element_run_t run = { (int16_t)(start - cx), (int16_t)(y - cy), length, 0 };
+            runs.push_back(run);
+        }
+    }
+    assert(runs.size() > 0); // The structuring element can not be empty
+
+    // The lengths are sorted, so the running min/max of a length can be found from the previous one
+    std::sort(lengths.begin(), lengths.end());
+    for (size_t i = 0; i < runs.size(); i++)
+        runs[i].lengthIndex = std::find(lengths.begin(), lengths.end(), runs[i].length) - lengths.begin();
+}
+
+// The presets are always an odd number of pixels wide, so they are symmetric around the center. Even sizes are rounded down,
+// which is the same window as morphologicalFilter uses, and zero is a single pixel
+static int presetSize(const uint8_t size) {
+    return 2 * ((size - 1) / 2) + 1;
+}
+
+StructuringElement StructuringElement::square(const uint8_t size) {
+    const int n = presetSize(size);
+    Mat mask(n, n, CV_8UC1);
+    for (int y = 0; y < n; y++) {
+        for (int x = 0; x < n; x++)
+            mask.at<uchar>(y, x) = 255;
+    }
+    return StructuringElement(&mask);
+}
+
+StructuringElement StructuringElement::disk(const uint8_t size) {
+    const int n = presetSize(size);
+    const int r = n / 2;
+    Mat mask(n, n, CV_8UC1);
+    for (int y = 0; y < n; y++) {
+        for (int x = 0; x < n; x++)
+            mask.at<uchar>(y, x) = (x - r) * (x - r) + (y - r) * (y - r) <= r * r ? 255 : 0;
+    }
+    return StructuringElement(&mask);
+}
+
+StructuringElement StructuringElement::cross(const uint8_t size) {
+    const int n = presetSize(size);
+    Mat mask(n, n, CV_8UC1);
+    const int r = n / 2;
+    for (int y = 0; y < n; y++) {
+        for (int x = 0; x < n; x++)
+            mask.at<uchar>(y, x) = x == r || y == r ? 255 : 0;
+    }
+    return StructuringElement(&mask);
+}
+
+StructuringElement StructuringElement::line(const uint8_t size, const double angle) {
+    const int n = presetSize(size);
+    Mat mask(n, n, CV_8UC1);
+    for (int y = 0; y < n; y++) {
+        for (int x = 0; x < n; x++)
+            mask.at<uchar>(y, x) = 0;
+    }
+
+    // Step one pixel at a time along the axis the line is closest to. The y-axis points down, so the sign is flipped
+    const int r = n / 2;
+    const double c = cos(angle * M_PI / 180.0), s = -sin(angle * M_PI / 180.0);
+    for (int i = -r; i <= r; i++) {
+        if (fabs(c) >= fabs(s))
+            mask.at<uchar>(r + (int)round(i * s / c), r + i) = 255;
+        else
+            mask.at<uchar>(r + i, r + (int)round(i * c / s)) = 255;
+    }
+    return StructuringElement(&mask);
+}
+
+// Arguments passed to the band function of the morphological filter using a structuring element
+typedef struct {
+    const PaddedImage *padded;
+    Mat *filteredImage;
+    const StructuringElement *structuringElement;
+} structuring_element_band_t;
+
+// The running min/max along every row of the padded image for each distinct run length is kept in a ring buffer
+// of the rows covered by the structuring element, so every row is only processed once per band
+template<bool useMax>
+static void structuringElementBand(void *arg, int yStart, int yStop) {
+    const structuring_element_band_t *band = (const structuring_element_band_t*)arg;
+    const PaddedImage *padded = band->padded;
+    const StructuringElement *element = band->structuringElement;
+    const std::vector<structuring_element_run_t> &runs = element->getRuns();
+    const std::vector<uint16_t> &lengths = element->getLengths();
+
+    const int width = padded->size().width;
+    const int paddedWidth = width + element->left + element->right;
+    const int rows = element->top + element->bottom + 1;
+    const int firstRow = yStart - element->top; // First row of the padded image used by the band
+
+    static thread_local std::vector<uint8_t> tableBuffer, gBuffer, hBuffer; // Kept between frames
+    tableBuffer.resize(max((size_t)lengths.size() * rows * paddedWidth, tableBuffer.size()));
+    gBuffer.resize(max((size_t)paddedWidth, gBuffer.size()));
+    hBuffer.resize(max((size_t)paddedWidth, hBuffer.size()));
+    uint8_t *tables = tableBuffer.data();
+
+    for (int y = firstRow; y < yStop + element->bottom; y++) {
+        // Add the running min/max of the row entering the ring buffer
+        const uchar *src = padded->ptr(-element->left, y);
+        const int slot = (y - firstRow) % rows;
+        for (size_t i = 0; i < lengths.size(); i++) {
+            uint8_t * __restrict table = &tables[(i * rows + slot) * paddedWidth];
+            const int tableWidth = paddedWidth - lengths[i] + 1;
+            const int d = i > 0 ? lengths[i] - lengths[i - 1] : 0;
+            if (i > 0 && d <= lengths[i - 1]) {
+                // The window [x; x + L) is the union of the previous windows starting at x and x + L - L', as these overlap
+                const uint8_t * __restrict previous = &tables[((i - 1) * rows + slot) * paddedWidth];
+                for (int x = 0; x < tableWidth; x++)
+                    table[x] = minMax<useMax>(previous[x], previous[x + d]);
+            } else
+                vanHerkRow<useMax>(src, table, tableWidth, lengths[i], gBuffer.data(), hBuffer.data());
+        }
+
+        const int outputRow = y - element->bottom;
+        if (outputRow < yStart)
+            continue; // The ring buffer is not filled yet
+
+        uchar * __restrict dst = band->filteredImage->ptr(outputRow);
+        memset(dst, useMax ? 0 : 255, width);
+        for (size_t j = 0; j < runs.size(); j++) {
+            const structuring_element_run_t &run = runs[j];
+            const int runSlot = (outputRow + run.dy - firstRow) % rows;
+            const uint8_t * __restrict table = &tables[(run.lengthIndex * rows + runSlot) * paddedWidth + run.dx + element->left];
+            for (int x = 0; x < width; x++)
+                dst[x] = minMax<useMax>(dst[x], table[x]);
+        }
+    }
+}
+
+Mat morphologicalFilter(const Mat *image, MorphologicalType type, const StructuringElement *structuringElement, bool whitePixels, BorderMode border) {
+    Mat filteredImage;
+    morphologicalFilter(image, &filteredImage, type, structuringElement, whitePixels, border);
+    return filteredImage;
+}
+
+void morphologicalFilter(const Mat *image, Mat *filteredImage, MorphologicalType type, const StructuringElement *structuringElement, bool whitePixels, BorderMode border) {
+    assert(image->channels() == 1); // Picture must be a greyscale image
+    assert(image->data != filteredImage->data); // The filter can not be applied in-place
+
+    static thread_local PaddedImage padded; // Kept between frames
+    padded.pad(image, structuringElement->top, structuringElement->bottom, structuringElement->left, structuringElement->right, border);
+
+    filteredImage->create(image->size(), image->type()); // Every pixel is written by the band function
+    const bool useMax = (type == DILATION && whitePixels) || (type == EROSION && !whitePixels); // Max is used for dilation when looking for white pixels
+    structuring_element_band_t band = { &padded, filteredImage, structuringElement };
+    ThreadPool::getInstance().run(useMax ? structuringElementBand<true> : structuringElementBand<false>, &band, image->size().height);
+}
+
+// One erosion or dilation in a sequence of morphological filters
+typedef struct {
+    bool useMax;
+    int n;
+} morphological_stage_t;
+
+static const uint8_t maxMorphologicalStages = 4;
+
+// Arguments passed to the band function of the fused morphological filters
+typedef struct {
+    const Mat *image;
+    Mat *filteredImage;
+    const morphological_stage_t *stages;
+    uint8_t nStages;
+    BorderMode border;
+    int tileRows;
+} morphological_stages_band_t;
+
+// Apply a stage to the rows [yStart; yStop). The input rows are looked up through 'rows', which is extended by the border,
+// so the vertical pass is done first. The result of the vertical pass is then extended by the border and filtered horizontally
+template<bool useMax>
+static void morphologicalStage(const uchar * const *rows, uchar * const *dst, const int nRows, const int width, const int n, const BorderMode border) {
+    const int k = 2 * n + 1;
+    const int length = nRows + 2 * n;
+
+    static thread_local std::vector<uint8_t> gBuffer, hBuffer, paddedBuffer, rowGBuffer, rowHBuffer; // Kept between frames
+    gBuffer.resize(max((size_t)length * width, gBuffer.size()));
+    hBuffer.resize(max((size_t)length * width, hBuffer.size()));
+    paddedBuffer.resize(max((size_t)width + 2 * n, paddedBuffer.size()));
+    rowGBuffer.resize(max((size_t)width + 2 * n, rowGBuffer.size()));
+    rowHBuffer.resize(max((size_t)width + 2 * n, rowHBuffer.size()));
+    const uint8_t *g = gBuffer.data(), *h = hBuffer.data();
+    uint8_t *padded = paddedBuffer.data();
+
+    vanHerkColumns<useMax>(rows, length, width, k, gBuffer.data(), hBuffer.data());
+    for (int i = 0; i < nRows; i++) {
+        for (int x = 0; x < width; x++)
+            padded[n + x] = minMax<useMax>(h[i * width + x], g[(i + k - 1) * width + x]);
+        for (int x = 0; x < n; x++) {
+            const int left = borderIndex(x - n, width, border), right = borderIndex(width + x, width, border);
+            padded[x] = left >= 0 ? padded[n + left] : 0;
+            padded[n + width + x] = right >= 0 ? padded[n + right] : 0;
+        }
+        vanHerkRow<useMax>(padded, dst[i], width, k, rowGBuffer.data(), rowHBuffer.data());
+    }
+}
+
+// The image is processed in tiles of rows, where every stage computes the rows needed by the next stage, so the intermediate
+// results stay in the cache and only the final result is written to the output image. Every stage only computes rows inside the
+// image and rows outside the image are looked up through the border, so the result is the same as applying the filters one by one
+static void morphologicalStagesBand(void *arg, int yStart, int yStop) {
+    const morphological_stages_band_t *band = (const morphological_stages_band_t*)arg;
+    const Mat *image = band->image;
+    const int width = image->size().width, height = image->size().height;
+    const uint8_t nStages = band->nStages;
+
+    static thread_local std::vector<uint8_t> stageBuffers[maxMorphologicalStages - 1], zeroBuffer; // Kept between frames
+    static thread_local std::vector<const uchar*> inputBuffer;
+    static thread_local std::vector<uchar*> outputBuffer;
+    zeroBuffer.assign(max((size_t)width, zeroBuffer.size()), 0);
+
+    for (int a = yStart; a < yStop; a += band->tileRows) {
+        const int b = min(a + band->tileRows, yStop);
+
+        // Find the rows each stage has to compute, starting from the last one
+        int lo[maxMorphologicalStages], hi[maxMorphologicalStages];
+        lo[nStages - 1] = a;
+        hi[nStages - 1] = b;
+        for (int s = nStages - 1; s > 0; s--) {
+            lo[s - 1] = max(0, lo[s] - band->stages[s].n);
+            hi[s - 1] = min(height, hi[s] + band->stages[s].n);
+        }
+
+        for (uint8_t s = 0; s < nStages; s++) {
+            const int n = band->stages[s].n;
+            const int nRows = hi[s] - lo[s], length = nRows + 2 * n;
+
+            inputBuffer.resize(max((size_t)length, inputBuffer.size()));
+            for (int i = 0; i < length; i++) {
+                const int y = borderIndex(lo[s] - n + i, height, band->border);
+                if (y < 0)
+                    inputBuffer[i] = zeroBuffer.data();
+                else if (s == 0)
+                    inputBuffer[i] = image->ptr(y);
+                else {
+                    assert(y >= lo[s - 1] && y < hi[s - 1]); // The row has to be computed by the previous stage
+                    inputBuffer[i] = &stageBuffers[s - 1][(y - lo[s - 1]) * width];
                 }
             }
-breakout:
-            filteredImage.data[index] = minMax; // Set pixel to min/max value of its neighbors
-            index++; // Increment index
+
+            outputBuffer.resize(max((size_t)nRows, outputBuffer.size()));
+            if (s < nStages - 1)
+                stageBuffers[s].resize(max((size_t)nRows * width, stageBuffers[s].size()));
+            for (int i = 0; i < nRows; i++)
+                outputBuffer[i] = s == nStages - 1 ? band->filteredImage->ptr(lo[s] + i) : &stageBuffers[s][i * width];
+
+            if (band->stages[s].useMax)
+                morphologicalStage<true>(inputBuffer.data(), outputBuffer.data(), nRows, width, n, band->border);
+            else
+                morphologicalStage<false>(inputBuffer.data(), outputBuffer.data(), nRows, width, n, band->border);
         }
     }
+}
+
+static void morphologicalStages(const Mat *image, Mat *filteredImage, const morphological_stage_t *stages, const uint8_t nStages, BorderMode border) {
+    assert(image->channels() == 1); // Picture must be a greyscale image
+    assert(image->data != filteredImage->data); // The filter can not be applied in-place
+    assert(nStages > 0 && nStages <= maxMorphologicalStages);
+
+    filteredImage->create(image->size(), image->type());
+
+    if (border == PAD_WRAP) {
+        // The rows at the top depend on the rows at the bottom of the previous stage, so the tiles can not be processed independently
+        static thread_local PingPongBuffer buffers; // Kept between frames
+        const Mat *in = image;
+        for (uint8_t s = 0; s < nStages; s++) {
+            Mat *out = s == nStages - 1 ? filteredImage : buffers.back(image->size(), image->type());
+            morphologicalFilter(in, out, stages[s].useMax ? DILATION : EROSION, 2 * stages[s].n + 1, true, border);
+            buffers.swap();
+            in = buffers.front();
+        }
+        return;
+    }
+
+    // Each stage adds its size to the rows above and below the tile, so the tiles are made large enough
+    // for this to be a small part of the work, but small enough to stay in the cache
+    int halo = 0;
+    for (uint8_t s = 0; s < nStages; s++)
+        halo += stages[s].n;
+    const int tileRows = max(max(1, 32 * 1024 / max(1, image->size().width)), 4 * halo);
+
+    morphological_stages_band_t band = { image, filteredImage, stages, nStages, border, tileRows };
+    ThreadPool::getInstance().run(morphologicalStagesBand, &band, image->size().height);
+}
+
+Mat morphologicalClose(const Mat *image, const uint8_t structuringElementSize, bool whitePixels, BorderMode border) {
+    Mat filteredImage;
+    morphologicalClose(image, &filteredImage, structuringElementSize, whitePixels, border);
+    return filteredImage;
+}
+
+void morphologicalClose(const Mat *image, Mat *filteredImage, const uint8_t structuringElementSize, bool whitePixels, BorderMode border) {
+    const int n = (structuringElementSize - 1)/2;
+    const morphological_stage_t stages[] = { { whitePixels, n }, { !whitePixels, n } }; // Dilation followed by erosion
+    morphologicalStages(image, filteredImage, stages, 2, border);
+}
+
+Mat morphologicalOpen(const Mat *image, const uint8_t structuringElementSize, bool whitePixels, BorderMode border) {
+    Mat filteredImage;
+    morphologicalOpen(image, &filteredImage, structuringElementSize, whitePixels, border);
     return filteredImage;
 }
+
+void morphologicalOpen(const Mat *image, Mat *filteredImage, const uint8_t structuringElementSize, bool whitePixels, BorderMode border) {
+    const int n = (structuringElementSize - 1)/2;
+    const morphological_stage_t stages[] = { { !whitePixels, n }, { whitePixels, n } }; // Erosion followed by dilation
+    morphologicalStages(image, filteredImage, stages, 2, border);
+}
+
+Mat closeThenOpen(const Mat *image, const uint8_t closingSize, const uint8_t openingSize, bool whitePixels, BorderMode border) {
+    Mat filteredImage;
+    closeThenOpen(image, &filteredImage, closingSize, openingSize, whitePixels, border);
+    return filteredImage;
+}
+
+void closeThenOpen(const Mat *image, Mat *filteredImage, const uint8_t closingSize, const uint8_t openingSize, bool whitePixels, BorderMode border) {
+    const int closing = (closingSize - 1)/2, opening = (openingSize - 1)/2;
+    const morphological_stage_t stages[] = {
+        { whitePixels, closing }, { !whitePixels, closing }, // Closing
+        { !whitePixels, opening }, { whitePixels, opening }, // Opening
+    };
+    morphologicalStages(image, filteredImage, stages, 4, border);
+}
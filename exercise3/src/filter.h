@@ -19,54 +19,239 @@
 #define __filter_h__
 
 #include <iostream>
+#include <vector>
+
+#include "border.h"
+#include "fft.h"
+#include "integral.h"
+#include "misc.h"
 
 using namespace cv;
 
+enum FilterPrecision {
+    FLOATING_POINT = 0,
+    FIXED_POINT, // Integer arithmetic, which is much faster on processors without a good FPU
+};
+
+enum ConvolutionMethod {
+    CONVOLUTION_AUTO = 0, // Select the cheapest method using a fixed cost model, so the result does not depend on timing
+    CONVOLUTION_DIRECT,
+    CONVOLUTION_SEPARABLE,
+    CONVOLUTION_FFT, // Frequency domain using overlap-add. Used for large kernels
+};
+
 enum MorphologicalType {
     EROSION = 0,
     DILATION,
 };
 
-Mat fractileFilter(const Mat *image, const uint8_t windowSize, const uint8_t percentile, bool skipBlackPixels);
-Mat morphologicalFilter(const Mat *image, MorphologicalType type, const uint8_t structuringElementSize, bool whitePixels);
+// A horizontal run of pixels in a structuring element, starting at (dx, dy) relative to the center
+typedef struct {
+    int16_t dx, dy;
+    uint16_t length;
+    uint16_t lengthIndex; // Index into the distinct run lengths of the structuring element
+} structuring_element_run_t;
+
+// Binary structuring element of any shape for the morphological filter. It is decomposed into horizontal runs, so the filter only needs a
+// running min/max along the rows for each distinct run length, which is then combined for all runs. A disk with a diameter of k then costs
+// O(k) per pixel instead of O(k^2)
+class StructuringElement {
+public:
+    // Every non-zero pixel in the mask is part of the structuring element, which is centered at (cols / 2, rows / 2)
+    StructuringElement(const Mat *mask);
+
+    // The presets have a width and height of 'size' rounded down to an odd number, so they are symmetric around the center,
+    // i.e. they have a radius of (size - 1) / 2. This is the same window as morphologicalFilter, and a size of zero is a single pixel
+    static StructuringElement square(const uint8_t size);
+    static StructuringElement disk(const uint8_t size);
+    static StructuringElement cross(const uint8_t size);
+    static StructuringElement line(const uint8_t size, const double angle); // The angle is in degrees counterclockwise from the x-axis
+
+    const std::vector<structuring_element_run_t> &getRuns(void) const {
+        return runs;
+    }
+
+    const std::vector<uint16_t> &getLengths(void) const {
+        return lengths;
+    }
+
+    // Number of pixels the structuring element extends above, below, to the left and to the right of the center
+    uint16_t top, bottom, left, right;
+
+private:
+    std::vector<structuring_element_run_t> runs;
+    std::vector<uint16_t> lengths; // The distinct run lengths
+};
+
+// The versions taking a destination write the result into it. The destination is only reallocated if it does not have the right size and type.
+// It does not have to be continuous, so it can be a region of a larger image. Note that the destination can not be the same as the source image.
+// The image is extended outside the border according to 'border', where PAD_CONSTANT pads with zeros. For the morphological filter
+// replicating the border is the same as only looking at the pixels inside the image.
+// When skipping black pixels, black pixels stay black and only the windows of the other pixels are evaluated, so the cost scales with the number of non-black pixels
+Mat fractileFilter(const Mat *image, const uint8_t windowSize, const uint8_t percentile, bool skipBlackPixels, BorderMode border = PAD_REPLICATE);
+void fractileFilter(const Mat *image, Mat *filteredImage, const uint8_t windowSize, const uint8_t percentile, bool skipBlackPixels, BorderMode border = PAD_REPLICATE);
+// Find several percentiles of the same window at once, i.e. the minimum, median and maximum using {0, 50, 100}. The window is only slid once,
+// so this is faster than filtering the image once per percentile. 'filteredImages' must point to an array with one image per percentile
+void fractileFilter(const Mat *image, Mat *filteredImages, const uint8_t windowSize, const uint8_t *percentiles, const uint8_t nPercentiles, bool skipBlackPixels, BorderMode border = PAD_REPLICATE);
+// Specialized fractile filter for thresholded images, where every non-zero pixel is treated as white. The result is the same as
+// the fractile filter for images only containing 0 and 255, but it only counts the white pixels in the window using popcount on bit-packed rows.
+// When skipping black pixels in a sparse image only the windows of the white pixels are evaluated
+Mat binaryFractileFilter(const Mat *image, const uint8_t windowSize, const uint8_t percentile, bool skipBlackPixels, BorderMode border = PAD_REPLICATE);
+void binaryFractileFilter(const Mat *image, Mat *filteredImage, const uint8_t windowSize, const uint8_t percentile, bool skipBlackPixels, BorderMode border = PAD_REPLICATE);
+Mat morphologicalFilter(const Mat *image, MorphologicalType type, const uint8_t structuringElementSize, bool whitePixels, BorderMode border = PAD_REPLICATE);
+void morphologicalFilter(const Mat *image, Mat *filteredImage, MorphologicalType type, const uint8_t structuringElementSize, bool whitePixels, BorderMode border = PAD_REPLICATE);
+// The same using any structuring element. The neighbourhood of a pixel is the structuring element placed with its center at the pixel
+Mat morphologicalFilter(const Mat *image, MorphologicalType type, const StructuringElement *structuringElement, bool whitePixels, BorderMode border = PAD_REPLICATE);
+void morphologicalFilter(const Mat *image, Mat *filteredImage, MorphologicalType type, const StructuringElement *structuringElement, bool whitePixels, BorderMode border = PAD_REPLICATE);
+
+// Morphological closing (dilation followed by erosion) and opening (erosion followed by dilation) and closing followed by opening.
+// The result is the same as calling morphologicalFilter for every step, but the steps are applied to tiles of rows, which stay in the cache,
+// so only the final result is written to memory
+Mat morphologicalClose(const Mat *image, const uint8_t structuringElementSize, bool whitePixels, BorderMode border = PAD_REPLICATE);
+void morphologicalClose(const Mat *image, Mat *filteredImage, const uint8_t structuringElementSize, bool whitePixels, BorderMode border = PAD_REPLICATE);
+Mat morphologicalOpen(const Mat *image, const uint8_t structuringElementSize, bool whitePixels, BorderMode border = PAD_REPLICATE);
+void morphologicalOpen(const Mat *image, Mat *filteredImage, const uint8_t structuringElementSize, bool whitePixels, BorderMode border = PAD_REPLICATE);
+Mat closeThenOpen(const Mat *image, const uint8_t closingSize, const uint8_t openingSize, bool whitePixels, BorderMode border = PAD_REPLICATE);
+void closeThenOpen(const Mat *image, Mat *filteredImage, const uint8_t closingSize, const uint8_t openingSize, bool whitePixels, BorderMode border = PAD_REPLICATE);
+
+// Memory used as the output of a filter. It is only reallocated if the image grows beyond the capacity,
+// so images of varying size (i.e. after cropping) can be filtered every frame without allocating any memory
+class ImageBuffer {
+public:
+    Mat *get(const Size size, int type) {
+        const size_t bytes = size.area() * CV_ELEM_SIZE(type);
+        if (storage.total() < bytes)
+            storage.create(1, bytes, CV_8UC1);
+        image = Mat(size, type, storage.data); // Only creates a new header
+        return &image;
+    }
+
+    Mat *get(void) {
+        return &image;
+    }
+
+private:
+    Mat storage, image;
+};
+
+// Two buffers used when chaining filters, so the output of one filter becomes the input of the next:
+//   morphologicalFilter(buffer.front(), buffer.back(), DILATION, size, true);
+//   buffer.swap();
+class PingPongBuffer {
+public:
+    PingPongBuffer(void) : current(0) {
+    }
+
+    // Result of the last filter
+    Mat *front(void) {
+        return buffers[current].get();
+    }
+
+    // Output of the next filter. It has the same size and type as the front buffer unless specified
+    Mat *back(void) {
+        return back(front()->size(), front()->type());
+    }
+
+    Mat *back(const Size size, int type) {
+        return buffers[!current].get(size, type);
+    }
+
+    // Call when the next filter is done, so the back buffer becomes the front buffer
+    void swap(void) {
+        current = !current;
+    }
+
+private:
+    ImageBuffer buffers[2];
+    uint8_t current;
+};
 
 class LinearFilter {
 public:
     // Assumes that the kernel is symmetric
-    LinearFilter(const float *coefficients, uint8_t _size) :
+    LinearFilter(const float *coefficients, uint16_t _size) :
         n(-0.5f + 0.5f * sqrtf(_size)),
         m(n),
         rows(2 * n + 1),
         columns(2 * m + 1),
         size(_size),
+        c(NULL),
+        h(NULL),
+        v(NULL),
+        cFixed(NULL),
+        tapIndex(NULL),
+        tapCoefficients(NULL),
+        tapFixedCoefficients(NULL),
+        tapOffsets(NULL),
+        spectrum(NULL),
+        precision(FLOATING_POINT),
+        method(CONVOLUTION_AUTO),
+        border(PAD_CONSTANT),
+        borderValue(0),
+        outputDepth(CV_8U),
         lastSum(0) {
         initCoefficients(coefficients, true);
     }
 
-    // Set kernel using n and m
-    LinearFilter(const float *coefficients, const uint8_t _n, const uint8_t _m) :
+    // Set kernel using n and m. The kernel is normalized unless '_normalize' is false
+    LinearFilter(const float *coefficients, const uint8_t _n, const uint8_t _m, bool _normalize = true) :
         n(_n),
         m(_m),
         rows(2 * n + 1),
         columns(2 * m + 1),
         size(rows * columns),
+        c(NULL),
+        h(NULL),
+        v(NULL),
+        cFixed(NULL),
+        tapIndex(NULL),
+        tapCoefficients(NULL),
+        tapFixedCoefficients(NULL),
+        tapOffsets(NULL),
+        spectrum(NULL),
+        precision(FLOATING_POINT),
+        method(CONVOLUTION_AUTO),
+        border(PAD_CONSTANT),
+        borderValue(0),
+        outputDepth(CV_8U),
         lastSum(0) {
-        initCoefficients(coefficients, true);
+        initCoefficients(coefficients, _normalize);
     }
 
     // Copy constructor
-    LinearFilter(const LinearFilter& filter) {
+    LinearFilter(const LinearFilter& filter) :
+        c(NULL),
+        h(NULL),
+        v(NULL),
+        cFixed(NULL),
+        tapIndex(NULL),
+        tapCoefficients(NULL),
+        tapFixedCoefficients(NULL),
+        tapOffsets(NULL),
+        spectrum(NULL) {
         swap(filter);
     }
 
     ~LinearFilter() {
         delete[] c;
+        delete[] h;
+        delete[] v;
+        delete[] cFixed;
+        delete[] tapIndex;
+        delete[] tapCoefficients;
+        delete[] tapFixedCoefficients;
+        delete[] tapOffsets;
+        delete[] spectrum;
     }
 
     inline Mat operator () (const Mat *q) {
         return apply(q); // Apply filter
     }
 
+    inline void operator () (const Mat *q, Mat *p) {
+        apply(q, p); // Apply filter
+    }
+
     // Assignment operator
     LinearFilter& operator = (const LinearFilter& filter) {
        if (this != &filter)
@@ -81,11 +266,11 @@ public:
 
     LinearFilter& operator += (const LinearFilter& filter) {
         if (lastSum != 0) { // Make sure that it has been normalized
-            for (uint8_t i = 0; i < size; i++)
+            for (uint16_t i = 0; i < size; i++)
                 c[i] *= lastSum; // Undo normalization
         }
         if (filter.lastSum != 0) { // Make sure that it has been normalized
-            for (uint8_t i = 0; i < size; i++)
+            for (uint16_t i = 0; i < size; i++)
                 c[i] *= filter.lastSum; // Undo normalization. We can just multiply the current filter with the other gain, as it has the same effect in the end
         }
         return *this = combineFilterKernels(*this, filter);
@@ -93,13 +278,14 @@ public:
 
     // Multiply all kernel coefficients with a gain
     LinearFilter& operator *= (const float gain) {
-        for (uint8_t i = 0; i < size; i++)
+        for (uint16_t i = 0; i < size; i++)
             c[i] *= gain;
         if (gain != 0) { // Prevent division with zero
             if (lastSum == 0)
                 lastSum = 1; // If it has not been set before, set it equal to the inverse of the gain
             lastSum /= gain; // Update last sum, so it can undo normalization correctly
         }
+        update(); // The separable, fixed point and frequency domain kernels have to be scaled as well
         return *this;
     }
 
@@ -108,21 +294,99 @@ public:
         return out;
     }
 
-    Mat apply(const Mat *q);
+    Mat apply(const Mat *q) {
+        Mat p;
+        apply(q, &p);
+        return p;
+    }
+
+    // Write the result into p, which is only reallocated if it does not have the same size as q and the type given by the output depth
+    void apply(const Mat *q, Mat *p);
+
+    // Select if the filter should use floating point or fixed point arithmetic
+    void setPrecision(FilterPrecision _precision) {
+        precision = _precision;
+    }
+
+    FilterPrecision getPrecision(void) const {
+        return precision;
+    }
+
+    // Returns the maximum difference in grey levels between the fixed point and the floating point output
+    uint8_t getFixedPointErrorBound(void) const {
+        return fixedPointErrorBound;
+    }
+
+    // Force a specific convolution method. By default the cheapest method is chosen for every image
+    void setMethod(ConvolutionMethod _method) {
+        method = _method;
+    }
+
+    ConvolutionMethod getMethod(void) const {
+        return method;
+    }
+
+    // Select how the image is extended outside the border. By default it is padded with zeros
+    void setBorder(BorderMode _border, float value = 0) {
+        border = _border;
+        borderValue = value;
+    }
+
+    BorderMode getBorder(void) const {
+        return border;
+    }
+
+    // Select the depth of the output image. CV_8U (default) constrains the response to [0; 255], while CV_16S and CV_32F
+    // keep the sign, so i.e. the zero-crossings of a Laplacian can be found without running the filter again
+    void setOutputDepth(int depth) {
+        assert(depth == CV_8U || depth == CV_16S || depth == CV_32F);
+        outputDepth = depth;
+    }
+
+    int getOutputDepth(void) const {
+        return outputDepth;
+    }
+
+    // Returns the method that will be used for an image of the given size.
+    // The estimated cost per sample relative to a single tap of the direct method is written to 'cost'
+    ConvolutionMethod selectMethod(const Size imageSize, uint16_t *fftSize = NULL, float *cost = NULL) const;
+
+    // Measure the cost of the separable and FFT methods relative to the direct method on this machine and use it instead of the
+    // default costs. The methods may round differently by one grey level, so after calibrating the output can differ between machines
+    static void calibrate(void);
 
     void printKernel(void) const {
         for (uint8_t i = 0; i < rows; i++) {
             for (uint8_t j = 0; j < columns; j++)
-                printf("%.2f\t", c[i * rows + j]);
+                printf("%.2f\t", c[i * columns + j]);
             printf("\n");
         }
     }
 
     uint8_t n, m;
     uint8_t rows, columns;
-    uint8_t size;
+    uint16_t size;
     float *c;
 
+    // Separable representation of the kernel as a sum of rank-1 terms, i.e. c = sum(v[r] * h[r]^T)
+    uint8_t rank; // Number of terms, is zero if the kernel is applied directly
+    float *h, *v; // Horizontal (rank x columns) and vertical (rank x rows) kernels
+
+    // Fixed point representation of the kernel, i.e. c = cFixed / 2^fractionBits
+    int16_t *cFixed;
+    uint8_t fractionBits;
+
+    // Non-zero taps used when the kernel is applied directly
+    uint16_t nTaps;
+    uint16_t *tapIndex; // Index into the kernel
+    float *tapCoefficients;
+    int16_t *tapFixedCoefficients;
+    int32_t *tapOffsets; // Offset into the image, which depends on the width and number of channels of the image
+
+    // Spectrum of the kernel used by the FFT convolution. It is calculated the first time it is needed
+    complex_t *spectrum;
+    uint16_t spectrumSize;
+
 private:
     void swap(const LinearFilter& filter) {
         n = filter.n;
@@ -130,42 +394,86 @@ private:
         rows = filter.rows;
         columns = filter.columns;
         size = filter.size;
+        precision = filter.precision;
+        method = filter.method;
+        border = filter.border;
+        borderValue = filter.borderValue;
+        outputDepth = filter.outputDepth;
         initCoefficients(filter.c, false); // Don't normalize, just copy data
     }
 
     void initCoefficients(const float *coefficients, bool _normalize) {
         //printf("n = %u m = %u rows = %u columns = %u size = %u normalize  = %u\n", n, m, rows, columns, size, _normalize);
 
+        delete[] c; // Release old kernel if the filter is being reassigned
         c = new float[size];
 
         float sum = 0;
-        for (uint8_t i = 0; i < size; i++) {
+        for (uint16_t i = 0; i < size; i++) {
             c[i] = coefficients[i];
             sum += c[i];
         }
         if (_normalize && sum != 0 && sum != 1)
             normalize();
+        update();
     }
 
     void normalize(void) {
         float sum = 0;
-        for (uint8_t i = 0; i < size; i++)
+        for (uint16_t i = 0; i < size; i++)
             sum += c[i];
 
-        float sum_new = 0;
+        float sum_new = 0, sum_abs = 0;
         if (sum < -0.0001f || sum > 0.0001f) { // Skip if value is very close to 0
-            for (uint8_t i = 0; i < size; i++) {
+            for (uint16_t i = 0; i < size; i++) {
                 c[i] /= sum; // Normalize data
                 sum_new += c[i];
+                sum_abs += fabsf(c[i]);
             }
             //printf("Normalized: %f %.2f\n", sum, sum_new);
-            assert(sum_new == 1.00f);
+            assert(fabsf(sum_new - 1.00f) < 0.0001f * max(1.0f, sum_abs)); // Rounding errors accumulate for large kernels
             lastSum = sum;
         }
     }
 
+    // Recalculate all the representations of the kernel, as the coefficients have changed
+    void update(void) {
+        factorize(); // Check if the kernel can be applied as a horizontal and vertical pass
+        quantize();
+        initTaps();
+        delete[] spectrum;
+        spectrum = NULL;
+        spectrumSize = 0;
+    }
+
+    void factorize(void);
+    void quantize(void);
+    void initTaps(void);
+    void updateTapOffsets(const int width, const uint8_t channels);
+    void updateSpectrum(const uint16_t fftSize);
+    void applyDirect(const Mat *q, Mat *p);
+    void applySeparable(const Mat *q, Mat *p);
+    void applyFixedPoint(const Mat *q, Mat *p);
+    void applyFFT(const Mat *q, Mat *p, const uint16_t fftSize);
+
     LinearFilter combineFilterKernels(const LinearFilter filter1, const LinearFilter filter2);
 
+    FilterPrecision precision;
+    uint8_t fixedPointErrorBound;
+    ConvolutionMethod method;
+    BorderMode border;
+    float borderValue; // Used by PAD_CONSTANT
+    int outputDepth;
+    int tapOffsetsWidth;
+    uint8_t tapOffsetsChannels;
+
+    // Cost of a single operation relative to a single tap of the direct method. Replaced by the measured costs in calibrate()
+    static float separableCost;
+    static float fftCost;
+
+    PaddedImage padded; // The image extended by the size of the kernel
+    Mat tmp, sum; // Buffers used by the separable and FFT methods, which are kept between frames
+
     float lastSum; // Used to undo normalization
 };
 
@@ -173,13 +481,157 @@ private:
 LinearFilter operator * (const LinearFilter& filter, const float gain);
 LinearFilter operator * (const float gain, const LinearFilter& filter);
 
+// A sequence of linear filters, which are applied one after another with floating point intermediate results.
+// As the filters are linear, the chain is equivalent to a single kernel, which is the convolution of all the kernels.
+// Either the combined kernel is applied in a single pass or the filters are applied one at a time, depending on which is cheaper
+class LinearFilterChain {
+public:
+    // An empty chain, which does not change the image
+    LinearFilterChain(void);
+
+    LinearFilterChain(const LinearFilter& filter, const float gain = 1);
+
+    // Add a filter to the end of the chain. The kernel is multiplied by the gain, but it is not normalized again
+    LinearFilterChain& add(const LinearFilter& filter, const float gain = 1);
+
+    LinearFilterChain& operator += (const LinearFilter& filter) {
+        return add(filter);
+    }
+
+    inline Mat operator () (const Mat *q) {
+        return apply(q); // Apply filter chain
+    }
+
+    inline void operator () (const Mat *q, Mat *p) {
+        apply(q, p); // Apply filter chain
+    }
+
+    Mat apply(const Mat *q) {
+        Mat p;
+        apply(q, &p);
+        return p;
+    }
+
+    // Write the result into p, which is only reallocated if it does not have the same size as q and the type given by the output depth
+    void apply(const Mat *q, Mat *p);
+
+    // Returns true if the combined kernel is cheaper than applying the filters one at a time for an image of the given size
+    bool isCombined(const Size imageSize) const;
+
+    LinearFilter *getCombinedFilter(void) {
+        return &combined;
+    }
+
+    uint8_t getNumFilters(void) const {
+        return nFilters;
+    }
+
+    // Select how the image is extended outside the border. The image is extended once by the size of the combined kernel and the passes
+    // are only applied where the following passes need them, so applying the filters one at a time gives the same result as the combined kernel
+    void setBorder(BorderMode _border, float value = 0) {
+        border = _border;
+        borderValue = value;
+        combined.setBorder(border, borderValue);
+    }
+
+    BorderMode getBorder(void) const {
+        return border;
+    }
+
+    // Select the depth of the output image just like LinearFilter::setOutputDepth. The intermediate results are always floating point
+    void setOutputDepth(int depth) {
+        outputDepth = depth;
+        combined.setOutputDepth(outputDepth);
+    }
+
+    int getOutputDepth(void) const {
+        return outputDepth;
+    }
+
+    // Measure the cost of the separate passes on this machine, which is used to decide if the kernels are combined. See LinearFilter::calibrate
+    static void calibrate(void);
+
+private:
+    // A single pass over the image. Filters with a rank-1 kernel are split into a horizontal and vertical pass
+    struct pass_t {
+        std::vector<float> coefficients; // Non-zero taps
+        std::vector<int16_t> k, l; // Vertical and horizontal position of the taps
+        uint8_t n, m; // Largest vertical and horizontal distance of the taps from the center
+    };
+
+    void addPasses(const LinearFilter& filter);
+    void applySeparate(const Mat *q, Mat *p);
+    uint32_t numTaps(void) const;
+    float separateCost(void) const;
+
+    uint8_t nFilters;
+    std::vector<pass_t> passes;
+    LinearFilter combined; // Convolution of all the kernels
+    BorderMode border;
+    float borderValue;
+    int outputDepth;
+    PaddedImage padded; // The input image extended by the size of the combined kernel
+    Mat buffers[2]; // Output of the passes, which has the same size as the padded image. They are kept between frames
+
+    // Cost of a single tap and of a whole pass per sample relative to a single tap of the direct method. Replaced by the measured costs in calibrate()
+    static float tapCost, passCost;
+};
+
+// Uniform filter, which averages all pixels in a width x height window. It uses an integral image, so the cost per pixel
+// is independent of the window size. Near the border only the pixels inside the image are averaged
+class BoxFilter {
+public:
+    BoxFilter(const uint8_t _width, const uint8_t _height) :
+        width(_width),
+        height(_height) {
+        assert(width > 0 && height > 0);
+    }
+
+    inline Mat operator () (const Mat *q) {
+        return apply(q); // Apply filter
+    }
+
+    inline void operator () (const Mat *q, Mat *p) {
+        apply(q, p); // Apply filter
+    }
+
+    Mat apply(const Mat *q) {
+        Mat p;
+        apply(q, &p);
+        return p;
+    }
+
+    // Write the result into p, which is only reallocated if it does not have the same size and type as q
+    void apply(const Mat *q, Mat *p) {
+        integral.compute(q);
+        apply(&integral, p);
+    }
+
+    // Use an integral image, which has already been calculated for this frame
+    void apply(const IntegralImage *integral, Mat *p) const;
+
+    // The integral image of the last image the filter was applied to, so other stages can reuse it
+    const IntegralImage *getIntegralImage(void) const {
+        return &integral;
+    }
+
+    uint8_t width, height;
+
+private:
+    IntegralImage integral;
+};
+
 class LowpassFilter : public LinearFilter {
 public:
     LowpassFilter() :
         LinearFilter(lowpass, sizeof(lowpass)/sizeof(lowpass[0])) {
     }
 
-    static const float lowpass[3 * 3];
+    static constexpr float lowpass[3 * 3] = {
+        1, 1, 1,
+        1, 1, 1,
+        1, 1, 1,
+    };
 };
 
 class HighpassFilter : public LinearFilter {
@@ -188,7 +640,11 @@ public:
         LinearFilter(highpass, sizeof(highpass)/sizeof(highpass[0])) {
     }
 
-    static const float highpass[3 * 3];
+    static constexpr float highpass[3 * 3] = {
+        -1, -1, -1,
+        -1,  8, -1,
+        -1, -1, -1,
+    };
 };
 
 class LaplacianFilter : public LinearFilter {
@@ -197,7 +653,11 @@ public:
         LinearFilter(laplacian, sizeof(laplacian)/sizeof(laplacian[0])) {
     }
 
-    static const float laplacian[3 * 3];
+    static constexpr float laplacian[3 * 3] = {
+        0,  1,  0,
+        1, -4,  1,
+        0,  1,  0,
+    };
 };
 
 class LaplacianTriangularFilter : public LinearFilter {
@@ -206,7 +666,11 @@ public:
         LinearFilter(laplacianTriangular, sizeof(laplacianTriangular)/sizeof(laplacianTriangular[0])) {
     }
 
-    static const float laplacianTriangular[3 * 3];
+    static constexpr float laplacianTriangular[3 * 3] = {
+        1,   0,  1,
+        0,  -4,  0,
+        1,   0,  1,
+    };
 };
 
 class LaplaceGaussianFilter : public LinearFilter {
@@ -215,7 +679,206 @@ public:
         LinearFilter(laplaceGaussian, sizeof(laplaceGaussian)/sizeof(laplaceGaussian[0])) {
     }
 
-    static const float laplaceGaussian[9 * 9];
+    static constexpr float laplaceGaussian[9 * 9] = {
+        0,  0,  1,   2,    2,   2,  1,  0, 0,
+        0,  1,  5,  10,   12,  10,  5,  1, 0,
+        1,  5, 15,  19,   16,  19, 15,  5, 1,
+        2, 10, 19, -19,  -64, -19, 19, 10, 2,
+        2, 12, 16, -64, -148, -64, 16, 12, 2,
+        2, 10, 19, -19,  -64, -19, 19, 10, 2,
+        1,  5, 15,  19,   16,  19, 15,  5, 1,
+        0,  1,  5,  10,   12,  10,  5,  1, 0,
+        0,  0,  1,   2,    2,   2,  1,  0, 0,
+    };
+};
+
+// Coefficients of the third order recursive Gaussian filter, which is applied as a causal and an anti-causal pass
+struct recursive_gaussian_t {
+    float B, b1, b2, b3;
+};
+
+// Gaussian filter implemented as recursive (IIR) filters in both directions, so the cost per pixel is independent of sigma.
+// See: I.T. Young and L.J. van Vliet, "Recursive implementation of the Gaussian filter", Signal Processing 44, 1995.
+// The derivatives are calculated using central differences of the smoothed image.
+// The border is extended by replicating the edge pixels. Sigma has to be at least 0.5, but the approximation is best for sigma above 2
+class RecursiveGaussianFilter {
+public:
+    RecursiveGaussianFilter(const float sigma, const uint8_t _orderX = 0, const uint8_t _orderY = 0) {
+        init(sigma, sigma, _orderX, _orderY);
+    }
+
+    RecursiveGaussianFilter(const float sigmaX, const float sigmaY, const uint8_t _orderX, const uint8_t _orderY) {
+        init(sigmaX, sigmaY, _orderX, _orderY);
+    }
+
+    inline Mat operator () (const Mat *q) {
+        return apply(q); // Apply filter
+    }
+
+    inline void operator () (const Mat *q, Mat *p) {
+        apply(q, p); // Apply filter
+    }
+
+    Mat apply(const Mat *q) {
+        Mat p;
+        apply(q, &p);
+        return p;
+    }
+
+    // Write the result into p, which is only reallocated if it does not have the same size and type as q
+    void apply(const Mat *q, Mat *p);
+
+    // The result is written as floating point, so negative values of the derivatives are kept
+    void applyFloat(const Mat *q, Mat *p);
+
+    float sigmaX, sigmaY;
+    uint8_t orderX, orderY; // Order of the derivative in each direction. Can be 0, 1 or 2
+
+protected:
+    bool laplacian; // Calculate the Laplacian of the smoothed image instead of the derivatives
+
+private:
+    void init(const float _sigmaX, const float _sigmaY, const uint8_t _orderX, const uint8_t _orderY);
+    void smooth(const Mat *q);
+
+    recursive_gaussian_t x, y;
+    Mat smoothed; // Kept between frames
 };
 
+// Laplacian of Gaussian of any scale. The image is smoothed by the recursive Gaussian filter after which the
+// Laplacian is calculated using central differences, so no explicit kernel is needed
+class RecursiveLaplaceGaussianFilter : public RecursiveGaussianFilter {
+public:
+    RecursiveLaplaceGaussianFilter(const float sigma) :
+        RecursiveGaussianFilter(sigma) {
+        laplacian = true;
+    }
+};
+
+// Used to unroll the kernel loops of StaticLinearFilter at compile time.
+// The taps are accumulated in the same order as LinearFilter, so the output is identical.
+template <typename Filter, int I>
+struct StaticKernelTap {
+    static inline float accumulate(const Filter& filter, const uchar *src, const int stride, const uint8_t channels) {
+        const float sum = StaticKernelTap<Filter, I - 1>::accumulate(filter, src, stride, channels);
+        if (Filter::isZero(I))
+            return sum; // Zero coefficients are known at compile time, so this tap is removed completely
+        const int k = I / Filter::columns - Filter::N, l = I % Filter::columns - Filter::M;
+        return sum + filter.coefficient(I) * (float)src[k * stride + l * channels];
+    }
+};
+
+template <typename Filter>
+struct StaticKernelTap<Filter, -1> {
+    static inline float accumulate(const Filter& filter, const uchar *src, const int stride, const uint8_t channels) {
+        return 0;
+    }
+};
+
+// Linear filter where the size of the kernel is known at compile time, so the compiler is able to fully unroll the kernel loops.
+// If the coefficients are given as a template argument they are known at compile time as well and all zero coefficients are removed.
+// For example: StaticLinearFilter<1, 1, LaplacianFilter::laplacian> or StaticLinearFilter<1, 1>(coefficients)
+template <uint8_t _N, uint8_t _M = _N, const float *C = nullptr>
+class StaticLinearFilter {
+public:
+    static const uint8_t N = _N, M = _M;
+    static const uint8_t rows = 2 * N + 1, columns = 2 * M + 1;
+    static const uint16_t size = rows * columns;
+
+    // Coefficients are given as a template argument
+    StaticLinearFilter(void) {
+        static_assert(C != nullptr, "Coefficients have to be given to the constructor");
+        for (uint16_t i = 0; i < size; i++)
+            c[i] = staticCoefficient(i);
+    }
+
+    // Coefficients are given at runtime. They are normalized just like LinearFilter does it
+    StaticLinearFilter(const float *coefficients) {
+        static_assert(C == nullptr, "Coefficients are already given as a template argument");
+        float sum = 0;
+        for (uint16_t i = 0; i < size; i++) {
+            c[i] = coefficients[i];
+            sum += c[i];
+        }
+        if (sum != 0 && sum != 1 && (sum < -0.0001f || sum > 0.0001f)) {
+            for (uint16_t i = 0; i < size; i++)
+                c[i] /= sum;
+        }
+    }
+
+    // Convert a LinearFilter with the same kernel size
+    explicit StaticLinearFilter(const LinearFilter& filter) {
+        static_assert(C == nullptr, "Coefficients are already given as a template argument");
+        assert(filter.n == N && filter.m == M);
+        memcpy(c, filter.c, sizeof(c)); // Already normalized
+    }
+
+    // Convert to a LinearFilter, so it can be combined with other filters
+    operator LinearFilter() const {
+        return LinearFilter(c, N, M);
+    }
+
+    inline Mat operator () (const Mat *q) const {
+        return apply(q); // Apply filter
+    }
+
+    inline void operator () (const Mat *q, Mat *p) const {
+        apply(q, p); // Apply filter
+    }
+
+    Mat apply(const Mat *q) const {
+        Mat p;
+        apply(q, &p);
+        return p;
+    }
+
+    // The image is padded with zeros, so the kernel is applied to every pixel without any bounds checking
+    void apply(const Mat *q, Mat *p) const {
+        assert(q->data != p->data); // The filter can not be applied in-place
+        static thread_local PaddedImage padded; // Kept between frames
+        padded.pad(q, N, M, PAD_CONSTANT);
+
+        const int height = q->size().height;
+        const int stride = padded.getStride();
+        const uint8_t channels = q->channels();
+        const size_t length = q->size().width * channels;
+
+        p->create(q->size(), q->type());
+        for (int y = 0; y < height; y++) {
+            // The pointers are restricted, so the compiler is able to vectorize the loop
+            const uchar * __restrict src = padded.ptr(0, y);
+            uchar * __restrict dst = p->ptr(y);
+            for (size_t i = 0; i < length; i++) {
+                const float value = StaticKernelTap<StaticLinearFilter, size - 1>::accumulate(*this, &src[i], stride, channels);
+                dst[i] = constrain(value, 0, 255); // Constrain data into valid range
+            }
+        }
+    }
+
+    static constexpr bool isZero(int i) {
+        return C != nullptr && C[i] == 0;
+    }
+
+    inline float coefficient(int i) const {
+        return C != nullptr ? staticCoefficient(i) : c[i];
+    }
+
+    float c[size];
+
+private:
+    static constexpr float staticSum(int i) {
+        return i == 0 ? 0 : staticSum(i - 1) + C[i - 1];
+    }
+
+    // Normalize the coefficients at compile time in the same way as LinearFilter
+    static constexpr float staticCoefficient(int i) {
+        return staticSum(size) != 0 && staticSum(size) != 1 && (staticSum(size) < -0.0001f || staticSum(size) > 0.0001f) ? C[i] / staticSum(size) : C[i];
+    }
+};
+
+typedef StaticLinearFilter<1, 1, LowpassFilter::lowpass> StaticLowpassFilter;
+typedef StaticLinearFilter<1, 1, HighpassFilter::highpass> StaticHighpassFilter;
+typedef StaticLinearFilter<1, 1, LaplacianFilter::laplacian> StaticLaplacianFilter;
+typedef StaticLinearFilter<1, 1, LaplacianTriangularFilter::laplacianTriangular> StaticLaplacianTriangularFilter;
+
 #endif
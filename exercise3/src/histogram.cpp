@@ -15,10 +15,14 @@
  e-mail   :  lauszus@gmail.com
 */
 
+#include <limits>
+#include <mutex>
+
 #include <opencv2/imgproc.hpp>
 
 #include "histogram.h"
 #include "misc.h"
+#include "threadpool.h"
 
 using namespace cv;
 
@@ -27,44 +31,97 @@ static int map(int x, int in_min, int in_max, int out_min, int out_max) {
     return constrain(value, out_min, out_max); // Limit output
 }
 
-void printHistogram(const histogram_t *histogram, uint8_t channels) {
+template<uint8_t nChannels, typename counter_t>
+void printHistogram(const channel_histogram_t<nChannels, counter_t> *histogram, uint8_t channels) {
+    assert(channels <= nChannels);
     for (uint16_t i = 0; i < histogram->nSize; i++) {
         for (uint8_t j = 0; j < channels; j++) {
-            if (histogram->data[i][j])
-                printf("[%u][%u] %u\n", i, j, histogram->data[i][j]);
+            if (histogram->data[j][i])
+                printf("[%u][%u] %u\n", i, j, (uint32_t)histogram->data[j][i]);
         }
     }
 }
 
-histogram_t getHistogram(const Mat *image) {
-    histogram_t histogram;
-    const uint8_t channels = image->channels();
+// Incrementing the same counter twice in a row makes the second load wait for the first store to be forwarded to it, which serializes
+// runs of equal values. Every thread therefore counts consecutive pixels into different sub-histograms, so the increments of a run
+// hit different counters and do not depend on each other. The sub-histograms of a thread are summed and then added to the shared histogram
+static const uint8_t nSubHistograms = 4;
+
+template<uint8_t nChannels, typename counter_t>
+struct histogram_band_t {
+    const Mat *image;
+    channel_histogram_t<nChannels, counter_t> *histogram;
+    std::mutex *mutex; // Protects the shared histogram
+};
+
+template<uint8_t channels, uint8_t nChannels, typename counter_t>
+static void histogramBand(void *arg, int yStart, int yStop) {
+    const histogram_band_t<nChannels, counter_t> *band = (const histogram_band_t<nChannels, counter_t>*)arg;
+    uint32_t counts[nSubHistograms][channels][histogram_t::nSize];
+    memset(counts, 0, sizeof(counts));
+
+    static const uint8_t chunkSize = 16 * channels; // Read 16 pixels at a time
+    const int rowSize = band->image->size().width * channels;
+    for (int y = yStart; y < yStop; y++) {
+        const uchar *row = band->image->ptr(y);
+        int i = 0;
+        for (; i <= rowSize - chunkSize; i += chunkSize) {
+            for (uint8_t k = 0; k < chunkSize; k += nSubHistograms * channels) { // The loop is unrolled, so the sub-histogram and channel are constants
+                for (uint8_t p = 0; p < nSubHistograms; p++) {
+                    for (uint8_t j = 0; j < channels; j++)
+                        counts[p][j][row[i + k + p * channels + j]]++;
+                }
+            }
+        }
+        for (; i < rowSize; i++)
+            counts[0][i % channels][row[i]]++;
+    }
 
-    size_t index = 0;
-    for (size_t i = 0; i < image->total(); i++) {
-        for (uint8_t j = 0; j < channels; j++) {
-            uchar value = image->data[index + j];
-            histogram.data[value][j]++;
+    std::lock_guard<std::mutex> lock(*band->mutex);
+    for (uint8_t j = 0; j < channels; j++) {
+        for (uint16_t value = 0; value < histogram_t::nSize; value++) {
+            uint32_t sum = 0;
+            for (uint8_t k = 0; k < nSubHistograms; k++)
+                sum += counts[k][j][value];
+            band->histogram->data[j][value] += sum;
         }
-        index += channels;
     }
+}
+
+template<uint8_t nChannels, typename counter_t>
+void getHistogram(const Mat *image, channel_histogram_t<nChannels, counter_t> *histogram) {
+    const uint8_t channels = image->channels();
+    assert(channels == 1 || channels == 3);
+    assert(channels <= nChannels); // The histogram must have room for all channels
+    assert(image->total() <= std::numeric_limits<counter_t>::max()); // The counters must not overflow
+
+    histogram->clear();
+    std::mutex mutex;
+    histogram_band_t<nChannels, counter_t> band = { image, histogram, &mutex };
+    ThreadPool::getInstance().run(channels == 1 ? histogramBand<1, nChannels, counter_t> : histogramBand<nChannels == 1 ? 1 : 3, nChannels, counter_t>,
+                                  &band, image->size().height);
 
 #if 0
     uint32_t total = 0;
-    for (uint16_t i = 0; i < histogram.nSize; i++) {
+    for (uint16_t i = 0; i < histogram->nSize; i++) {
         for (uint8_t j = 0; j < channels; j++) {
-            //printf("[%u][%u] = %d\n", i, j, histogram.data[i][j]);
-            total += histogram.data[i][j];
+            //printf("[%u][%u] = %d\n", i, j, histogram->data[j][i]);
+            total += histogram->data[j][i];
         }
     }
     printf("%u == %lu\n", total, image->total() * channels); // Should be equal to "image.total() * image.channels()"
     assert(total == image->total() * channels);
 #endif
+}
 
+histogram_t getHistogram(const Mat *image) {
+    histogram_t histogram;
+    getHistogram(image, &histogram);
     return histogram;
 }
 
-Mat drawHistogram(const histogram_t *histogram, const Mat *image, const Size imageSize, int thresholdValue /*= -1*/) {
+template<uint8_t nChannels, typename counter_t>
+Mat drawHistogram(const channel_histogram_t<nChannels, counter_t> *histogram, const Mat *image, const Size imageSize, int thresholdValue /*= -1*/) {
     Mat hist(imageSize, CV_8UC3);
     rectangle(hist, Point(0, 0), hist.size(), Scalar(255, 255, 255, 0), CV_FILLED); // White background
 
@@ -73,15 +130,16 @@ Mat drawHistogram(const histogram_t *histogram, const Mat *image, const Size ima
     static const uint8_t startY = offset;
     const int endX = hist.size().width - offset;
     const int endY = hist.size().height - offset;
+    const uint8_t channels = min(image->channels(), (int)nChannels);
 
     line(hist, Point(startX, endY), Point(endX, endY), Scalar(0)); // x-axis
     line(hist, Point(startX, startY), Point(startX, endY), Scalar(0)); // y-axis
 
     int maxHist = 0;
-    for (uint16_t i = 0; i < histogram->nSize; i++) {
-        for (uint8_t j = 0; j < image->channels(); j++) {
-            if (histogram->data[i][j] > maxHist)
-                maxHist = histogram->data[i][j];
+    for (uint8_t j = 0; j < channels; j++) {
+        for (uint16_t i = 0; i < histogram->nSize; i++) {
+            if (histogram->data[j][i] > maxHist)
+                maxHist = histogram->data[j][i];
         }
     }
 
@@ -91,12 +149,22 @@ Mat drawHistogram(const histogram_t *histogram, const Mat *image, const Size ima
         if (i == thresholdValue)
             line(hist, Point(posX, startY), Point(posX, endY), Scalar(0, 0, 255, 0)); // Draw red threshold line
 
-        for (uint8_t j = 0; j < image->channels(); j++)
-            line(hist, Point(posX, endY - map(histogram->data[i][j], 0, maxHist, 0, endY - offset)), Point(posX, endY),
+        for (uint8_t j = 0; j < channels; j++)
+            line(hist, Point(posX, endY - map(histogram->data[j][i], 0, maxHist, 0, endY - offset)), Point(posX, endY),
                                             /* Draw in colors if color image, else draw black if greyscale */
-                                            Scalar(j == 0 && image->channels() > 1 ? 255 : 0,
+                                            Scalar(j == 0 && channels > 1 ? 255 : 0,
                                                      j == 1 ? 255 : 0,
                                                      j == 2 ? 255 : 0, 0));
     }
     return hist;
 }
+
+#define INSTANTIATE_HISTOGRAM(nChannels, counter_t) \
+    template void printHistogram(const channel_histogram_t<nChannels, counter_t> *histogram, uint8_t channels); \
+    template void getHistogram(const Mat *image, channel_histogram_t<nChannels, counter_t> *histogram); \
+    template Mat drawHistogram(const channel_histogram_t<nChannels, counter_t> *histogram, const Mat *image, const Size imageSize, int thresholdValue);
+
+INSTANTIATE_HISTOGRAM(1, uint16_t)
+INSTANTIATE_HISTOGRAM(1, uint32_t)
+INSTANTIATE_HISTOGRAM(3, uint16_t)
+INSTANTIATE_HISTOGRAM(3, uint32_t)
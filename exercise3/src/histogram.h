@@ -20,16 +20,92 @@
 
 using namespace cv;
 
-struct histogram_t {
-    histogram_t(void) {
+// Histogram with a fixed number of channels. The layout is planar, so all bins of a channel are contiguous in memory.
+// 16-bit counters can be used when less than 65536 pixels are counted, e.g. for a small window
+template<uint8_t nChannels, typename counter_t = uint32_t>
+struct channel_histogram_t {
+    channel_histogram_t(void) {
+        clear();
+    }
+    void clear(void) {
         memset(data, 0, sizeof(data)); // Make sure all elements are zero
     }
     static const uint16_t nSize = 256;
-    uint32_t data[nSize][3]; // Data for three channels
+    static const uint8_t channels = nChannels;
+    counter_t data[nChannels][nSize];
 };
 
-void printHistogram(const histogram_t *histogram, uint8_t channels);
+typedef channel_histogram_t<3> histogram_t; // Data for up to three channels
+typedef channel_histogram_t<1> grey_histogram_t;
+
+// Histogram of a single channel with 16 coarse bins of 16 fine bins each, so a percentile can be found by first searching the
+// coarse bins and then only the 16 fine bins of the coarse bin containing it. The counters are 16-bit, which is enough for 255 x 255 pixels
+struct two_level_histogram_t {
+    static const uint16_t nCoarse = 16, nFine = 16;
+    uint16_t coarse[nCoarse];
+    uint16_t fine[nCoarse * nFine];
+
+    void clear(void) {
+        memset(coarse, 0, sizeof(coarse));
+        memset(fine, 0, sizeof(fine));
+    }
+
+    void add(uint8_t value) {
+        coarse[value / nFine]++;
+        fine[value]++;
+    }
+
+    void remove(uint8_t value) {
+        coarse[value / nFine]--;
+        fine[value]--;
+    }
+
+    void addRemove(uint8_t value, bool add) {
+        if (add)
+            this->add(value);
+        else
+            remove(value);
+    }
+
+    // Add the histogram entering a window and subtract the one leaving it. The pointers are restricted, so the compiler is able to vectorize the loops
+    void slide(const two_level_histogram_t * __restrict enter, const two_level_histogram_t * __restrict leave) {
+        for (uint16_t i = 0; i < nCoarse; i++)
+            coarse[i] += enter->coarse[i] - leave->coarse[i];
+        for (uint16_t i = 0; i < nCoarse * nFine; i++)
+            fine[i] += enter->fine[i] - leave->fine[i];
+    }
+
+    void add(const two_level_histogram_t * __restrict histogram) {
+        for (uint16_t i = 0; i < nCoarse; i++)
+            coarse[i] += histogram->coarse[i];
+        for (uint16_t i = 0; i < nCoarse * nFine; i++)
+            fine[i] += histogram->fine[i];
+    }
+
+    // Returns the first value where the cumulative count reaches 'position' or 255 if it is never reached
+    uint8_t percentile(uint32_t position) const {
+        uint32_t total = 0;
+        uint8_t c = 0;
+        while (c < nCoarse - 1 && total + coarse[c] < position)
+            total += coarse[c++];
+        uint16_t value = c * nFine;
+        for (; value < 255; value++) {
+            total += fine[value];
+            if (total >= position)
+                break;
+        }
+        return value;
+    }
+};
+
+// Implemented for one and three channels with 16-bit and 32-bit counters
+template<uint8_t nChannels, typename counter_t>
+void printHistogram(const channel_histogram_t<nChannels, counter_t> *histogram, uint8_t channels = nChannels);
+template<uint8_t nChannels, typename counter_t>
+void getHistogram(const Mat *image, channel_histogram_t<nChannels, counter_t> *histogram);
+template<uint8_t nChannels, typename counter_t>
+Mat drawHistogram(const channel_histogram_t<nChannels, counter_t> *histogram, const Mat *image, const Size imageSize, int thresholdValue = -1);
+
 histogram_t getHistogram(const Mat *image);
-Mat drawHistogram(const histogram_t *histogram, const Mat *image, const Size imageSize, int thresholdValue = -1);
 
 #endif
@@ -0,0 +1,53 @@
+/* Copyright (C) 2015 Kristian Sloth Lauszus. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Sloth Lauszus
+ Web      :  http://www.lauszus.com
+ e-mail   :  lauszus@gmail.com
+*/
+
+#include <opencv2/core.hpp>
+
+#include "integral.h"
+
+using namespace cv;
+
+void IntegralImage::compute(const Mat *image) {
+    width = image->size().width;
+    height = image->size().height;
+    channels = image->channels();
+    assert(channels <= 3);
+    assert(image->total() <= (uint32_t)~0 / 255); // The sum of the whole image has to fit in 32-bits
+
+    const size_t stride = (width + 1) * channels;
+    if (buffer.total() < (height + 1) * stride)
+        buffer.create(1, (height + 1) * stride, CV_32SC1);
+    uint32_t *integral = (uint32_t*)buffer.data;
+    data = integral;
+    memset(integral, 0, stride * sizeof(uint32_t)); // First row is zero
+
+    for (int y = 0; y < height; y++) {
+        const uchar *src = &image->data[y * width * channels];
+        const uint32_t *above = &integral[y * stride];
+        uint32_t *dst = &integral[(y + 1) * stride];
+
+        uint32_t rowSum[3] = { 0, 0, 0 };
+        for (uint8_t i = 0; i < channels; i++)
+            dst[i] = 0; // First column is zero
+        for (int x = 0; x < width; x++) {
+            for (uint8_t i = 0; i < channels; i++) {
+                rowSum[i] += src[x * channels + i];
+                dst[(x + 1) * channels + i] = above[(x + 1) * channels + i] + rowSum[i];
+            }
+        }
+    }
+}
@@ -0,0 +1,75 @@
+/* Copyright (C) 2015 Kristian Sloth Lauszus. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Sloth Lauszus
+ Web      :  http://www.lauszus.com
+ e-mail   :  lauszus@gmail.com
+*/
+
+#ifndef __integral_h__
+#define __integral_h__
+
+using namespace cv;
+
+// Integral image (summed-area table), where each element is the sum of all pixels above and to the left of it.
+// It has one extra row and column of zeros, so the sum of any rectangle only takes four lookups.
+// It can be calculated once per frame and then be shared by all stages that need sums of rectangles
+class IntegralImage {
+public:
+    IntegralImage(void) :
+        data(NULL),
+        width(0),
+        height(0),
+        channels(0) {
+    }
+
+    IntegralImage(const Mat *image) :
+        data(NULL) {
+        compute(image);
+    }
+
+    // The memory is only reallocated if the image gets larger
+    void compute(const Mat *image);
+
+    // Sum of all pixels in the rectangle for the given channel. The rectangle has to be inside the image
+    inline uint32_t sum(const Rect rect, const uint8_t channel = 0) const {
+        return sum(rect.x, rect.y, rect.x + rect.width, rect.y + rect.height, channel);
+    }
+
+    // Sum of the pixels in [x0; x1) and [y0; y1)
+    inline uint32_t sum(const int x0, const int y0, const int x1, const int y1, const uint8_t channel = 0) const {
+        const size_t stride = (width + 1) * channels;
+        const uint32_t *top = &data[y0 * stride + channel], *bottom = &data[y1 * stride + channel];
+        return bottom[x1 * channels] - bottom[x0 * channels] - top[x1 * channels] + top[x0 * channels];
+    }
+
+    Size size(void) const {
+        return Size(width, height);
+    }
+
+    uint8_t getChannels(void) const {
+        return channels;
+    }
+
+    // The integral image is stored as (height + 1) x (width + 1) with interleaved channels
+    const uint32_t *getData(void) const {
+        return data;
+    }
+
+private:
+    Mat buffer;
+    const uint32_t *data;
+    int width, height;
+    uint8_t channels;
+};
+
+#endif
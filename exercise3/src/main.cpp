@@ -25,9 +25,42 @@ using namespace cv;
 
 #define WEBCAM 0
 #define PRINT_SPEED 0
+#define BENCHMARK_HISTOGRAM 0 // Compare getHistogram against a single-threaded loop with a single histogram
 
 static bool windowSizeChanged;
 
+#if BENCHMARK_HISTOGRAM
+static histogram_t getHistogramSimple(const Mat *image) {
+    histogram_t histogram;
+    const uint8_t channels = image->channels();
+    size_t index = 0;
+    for (size_t i = 0; i < image->total(); i++) {
+        for (uint8_t j = 0; j < channels; j++)
+            histogram.data[j][image->data[index + j]]++;
+        index += channels;
+    }
+    return histogram;
+}
+
+static void benchmarkHistogram(const Mat *image) {
+    static const uint16_t nRuns = 1000;
+    histogram_t histogram, histogramSimple;
+
+    int64_t timer = getTickCount();
+    for (uint16_t i = 0; i < nRuns; i++)
+        histogram = getHistogram(image);
+    double time = (double)(getTickCount() - timer) / getTickFrequency() * 1000.0 / nRuns;
+
+    timer = getTickCount();
+    for (uint16_t i = 0; i < nRuns; i++)
+        histogramSimple = getHistogramSimple(image);
+    double timeSimple = (double)(getTickCount() - timer) / getTickFrequency() * 1000.0 / nRuns;
+
+    bool equal = memcmp(histogram.data, histogramSimple.data, sizeof(histogram.data)) == 0;
+    printf("Histogram of %d channel(s): %.3f ms VS %.3f ms\t%.2f\t%s\n", image->channels(), time, timeSimple, timeSimple / time, equal ? "equal" : "NOT EQUAL");
+}
+#endif
+
 void thresholdCallBack(int pos) {
     windowSizeChanged  = true;
 }
@@ -136,12 +169,23 @@ restart:
     //static Mat image = imageFull(Rect(2, 2, imageFull.size().width - 2 * 2, imageFull.size().height - 2 * 2)).clone(); // Crop two pixels from both sides
     //imshow("Image", image);
 #endif
+#if BENCHMARK_HISTOGRAM
+    static bool benchmarkDone;
+    if (!benchmarkDone) {
+        Mat imageGrey;
+        cvtColor(image, imageGrey, COLOR_BGR2GRAY);
+        benchmarkHistogram(&image);
+        benchmarkHistogram(&imageGrey);
+        benchmarkDone = true;
+    }
+#endif
 #if 0
     printf("Image size: %lu, width: %d, height: %d, total: %lu, channels: %d\n",
             image.total() * image.channels(), image.size().width, image.size().height, image.total(), image.channels());
 #endif
 
     LinearFilter *filter;
+    LinearFilterChain *filterChain = NULL;
     char filterName[50];
     static int8_t imageN = 0;
     if (imageN < 0)
@@ -162,8 +206,10 @@ restart:
         filter = &laplacianFilter;
     } else if (imageN == 3) {
         strcpy(filterName, "LaplacianLowpassFilter");
-        static LinearFilter linearFilter = LaplacianFilter() + LowpassFilter();
-        filter = &linearFilter;
+        // The gain undoes the normalization of the lowpass filter, just like when the kernels are combined using the + operator
+        static LinearFilterChain linearFilterChain = LinearFilterChain(LaplacianFilter()).add(LowpassFilter(), 9);
+        filterChain = &linearFilterChain;
+        filter = filterChain->getCombinedFilter(); // Used by filter2D below
     } else if (imageN == 4) {
         strcpy(filterName, "LaplacianTriangularFilter");
         static LaplacianTriangularFilter laplacianTriangularFilter;
@@ -178,7 +224,7 @@ restart:
 #if PRINT_SPEED
     int64_t timer = getTickCount();
 #endif
-    Mat filteredImage = filter->apply(&image);
+    Mat filteredImage = filterChain ? filterChain->apply(&image) : filter->apply(&image);
 #if PRINT_SPEED
     uint32_t count1 = getTickCount() - timer;
 #endif
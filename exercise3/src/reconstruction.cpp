@@ -0,0 +1,200 @@
+/* Copyright (C) 2015 Kristian Sloth Lauszus. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Sloth Lauszus
+ Web      :  http://www.lauszus.com
+ e-mail   :  lauszus@gmail.com
+*/
+
+#include <opencv2/core.hpp>
+
+#include "reconstruction.h"
+
+using namespace cv;
+
+// The images are copied into buffers with a border of one pixel, which is zero in both the marker and the mask,
+// so it never changes and the neighbours of a pixel can be accessed without checking the bounds
+typedef struct {
+    std::vector<uint8_t> marker, mask;
+    std::vector<int32_t> queue;
+    int width, height; // Size of the padded image
+} reconstruction_buffers_t;
+
+static reconstruction_buffers_t *getBuffers(const Size size) {
+    static thread_local reconstruction_buffers_t buffers; // Kept between frames
+    buffers.width = size.width + 2;
+    buffers.height = size.height + 2;
+    const size_t total = buffers.width * buffers.height;
+    buffers.marker.resize(max(total, buffers.marker.size()));
+    buffers.mask.resize(max(total, buffers.mask.size()));
+    memset(buffers.marker.data(), 0, total); // Clear the border
+    memset(buffers.mask.data(), 0, total);
+    return &buffers;
+}
+
+// Copy an image into the inside of a padded buffer. If 'invert' is set the complement of the image is copied
+static void copyToPadded(const Mat *image, uint8_t *padded, bool invert) {
+    const int width = image->size().width;
+    for (int y = 0; y < image->size().height; y++) {
+        const uchar *src = image->ptr(y);
+        uint8_t *dst = &padded[(y + 1) * (width + 2) + 1];
+        for (int x = 0; x < width; x++)
+            dst[x] = invert ? 255 - src[x] : src[x];
+    }
+}
+
+static void copyFromPadded(const uint8_t *padded, Mat *image, bool invert) {
+    const int width = image->size().width;
+    for (int y = 0; y < image->size().height; y++) {
+        const uint8_t *src = &padded[(y + 1) * (width + 2) + 1];
+        uchar *dst = image->ptr(y);
+        for (int x = 0; x < width; x++)
+            dst[x] = invert ? 255 - src[x] : src[x];
+    }
+}
+
+// Reconstruction by dilation of the padded marker under the padded mask. The result is written into the marker
+static void reconstructByDilation(reconstruction_buffers_t *buffers, Connected connected) {
+    assert(connected == CONNECTED_4 || connected == CONNECTED_8);
+    const int width = buffers->width, height = buffers->height;
+    uint8_t *J = buffers->marker.data();
+    const uint8_t *I = buffers->mask.data();
+
+    // Offsets to the neighbours before a pixel in raster order. The neighbours after it are the negated offsets
+    const int offsets[] = { -1, -width, -width - 1, -width + 1 };
+    const uint8_t nNeighbours = connected == CONNECTED_8 ? 4 : 2;
+
+    for (int y = 1; y < height - 1; y++) { // Raster scan
+        for (int x = 1; x < width - 1; x++) {
+            const int p = y * width + x;
+            uint8_t value = J[p];
+            for (uint8_t i = 0; i < nNeighbours; i++)
+                value = max(value, J[p + offsets[i]]);
+            J[p] = min(value, I[p]);
+        }
+    }
+
+    std::vector<int32_t> &queue = buffers->queue;
+    queue.clear(); // Keeps the capacity
+    for (int y = height - 2; y >= 1; y--) { // Anti-raster scan
+        for (int x = width - 2; x >= 1; x--) {
+            const int p = y * width + x;
+            uint8_t value = J[p];
+            for (uint8_t i = 0; i < nNeighbours; i++)
+                value = max(value, J[p - offsets[i]]);
+            J[p] = min(value, I[p]);
+
+            // The pixel can still propagate to a neighbour after it, so it is added to the queue
+            for (uint8_t i = 0; i < nNeighbours; i++) {
+                const int q = p - offsets[i];
+                if (J[q] < J[p] && J[q] < I[q]) {
+                    queue.push_back(p);
+                    break;
+                }
+            }
+        }
+    }
+
+    // Propagate the changes. The border pixels are zero in the mask, so they are never added
+    for (size_t head = 0; head < queue.size(); head++) {
+        const int p = queue[head];
+        for (uint8_t i = 0; i < 2 * nNeighbours; i++) {
+            const int q = i < nNeighbours ? p + offsets[i] : p - offsets[i - nNeighbours];
+            if (J[q] < J[p] && I[q] != J[q]) {
+                J[q] = min(J[p], I[q]);
+                queue.push_back(q);
+            }
+        }
+    }
+}
+
+void morphologicalReconstruction(const Mat *marker, const Mat *mask, Mat *reconstructed, MorphologicalType type, Connected connected) {
+    assert(marker->channels() == 1 && mask->channels() == 1); // The images must be greyscale images
+    assert(marker->size() == mask->size());
+
+    // Reconstruction by erosion is the complement of the reconstruction by dilation of the complements
+    const bool invert = type == EROSION;
+    reconstruction_buffers_t *buffers = getBuffers(marker->size());
+    copyToPadded(marker, buffers->marker.data(), invert);
+    copyToPadded(mask, buffers->mask.data(), invert);
+    for (int i = 0; i < buffers->width * buffers->height; i++)
+        buffers->marker[i] = min(buffers->marker[i], buffers->mask[i]); // The marker has to be below the mask
+
+    reconstructByDilation(buffers, connected);
+
+    reconstructed->create(marker->size(), CV_8UC1);
+    copyFromPadded(buffers->marker.data(), reconstructed, invert);
+}
+
+Mat fillHoles(const Mat *image, Connected connected) {
+    Mat filledImage;
+    fillHoles(image, &filledImage, connected);
+    return filledImage;
+}
+
+void fillHoles(const Mat *image, Mat *filledImage, Connected connected) {
+    assert(image->channels() == 1); // The image must be in black and white
+
+    // Reconstruct the black pixels from the black pixels at the border of the image. Everything that is not reached is a hole
+    const int width = image->size().width, height = image->size().height;
+    reconstruction_buffers_t *buffers = getBuffers(image->size());
+    uint8_t *marker = buffers->marker.data(), *mask = buffers->mask.data();
+    for (int y = 0; y < height; y++) {
+        const uchar *src = image->ptr(y);
+        for (int x = 0; x < width; x++) {
+            const int p = (y + 1) * buffers->width + x + 1;
+            mask[p] = src[x] ? 0 : 255;
+            if (x == 0 || y == 0 || x == width - 1 || y == height - 1)
+                marker[p] = mask[p];
+        }
+    }
+
+    reconstructByDilation(buffers, connected == CONNECTED_8 ? CONNECTED_4 : CONNECTED_8);
+
+    filledImage->create(image->size(), CV_8UC1);
+    copyFromPadded(marker, filledImage, true);
+}
+
+Mat removeBorderObjects(const Mat *image, Connected connected) {
+    Mat filteredImage;
+    removeBorderObjects(image, &filteredImage, connected);
+    return filteredImage;
+}
+
+void removeBorderObjects(const Mat *image, Mat *filteredImage, Connected connected) {
+    assert(image->channels() == 1); // The image must be in black and white
+
+    // Reconstruct the white pixels from the white pixels at the border of the image. Everything that is reached is removed
+    const int width = image->size().width, height = image->size().height;
+    reconstruction_buffers_t *buffers = getBuffers(image->size());
+    uint8_t *marker = buffers->marker.data(), *mask = buffers->mask.data();
+    for (int y = 0; y < height; y++) {
+        const uchar *src = image->ptr(y);
+        for (int x = 0; x < width; x++) {
+            const int p = (y + 1) * buffers->width + x + 1;
+            mask[p] = src[x] ? 255 : 0;
+            if (x == 0 || y == 0 || x == width - 1 || y == height - 1)
+                marker[p] = mask[p];
+        }
+    }
+
+    reconstructByDilation(buffers, connected);
+
+    filteredImage->create(image->size(), CV_8UC1);
+    for (int y = 0; y < height; y++) {
+        const uint8_t *reached = &marker[(y + 1) * buffers->width + 1];
+        const uint8_t *white = &mask[(y + 1) * buffers->width + 1];
+        uchar *dst = filteredImage->ptr(y);
+        for (int x = 0; x < width; x++)
+            dst[x] = reached[x] ? 0 : white[x];
+    }
+}
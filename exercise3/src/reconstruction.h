@@ -0,0 +1,41 @@
+/* Copyright (C) 2015 Kristian Sloth Lauszus. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Sloth Lauszus
+ Web      :  http://www.lauszus.com
+ e-mail   :  lauszus@gmail.com
+*/
+
+#ifndef __reconstruction_h__
+#define __reconstruction_h__
+
+#include "filter.h"
+#include "misc.h"
+
+using namespace cv;
+
+// Geodesic reconstruction of 'marker' by dilation under 'mask' or by erosion over 'mask', i.e. the marker is dilated (eroded)
+// and limited by the mask until it does not change anymore. Uses the hybrid algorithm by L. Vincent, "Morphological Grayscale
+// Reconstruction in Image Analysis: Applications and Efficient Algorithms", 1993, which does a raster and anti-raster scan and then
+// propagates the remaining changes using a FIFO queue, so the time is linear in the number of pixels. Only CONNECTED_4 and CONNECTED_8 are supported
+void morphologicalReconstruction(const Mat *marker, const Mat *mask, Mat *reconstructed, MorphologicalType type, Connected connected = CONNECTED_8);
+
+// Fill all black regions in a black and white image, which are not connected to the border of the image.
+// 'connected' is the connectivity of the white objects, so the black regions use the other connectivity
+Mat fillHoles(const Mat *image, Connected connected = CONNECTED_8);
+void fillHoles(const Mat *image, Mat *filledImage, Connected connected = CONNECTED_8);
+
+// Remove all white objects, which touch the border of the image
+Mat removeBorderObjects(const Mat *image, Connected connected = CONNECTED_8);
+void removeBorderObjects(const Mat *image, Mat *filteredImage, Connected connected = CONNECTED_8);
+
+#endif
@@ -0,0 +1,138 @@
+/* Copyright (C) 2015 Kristian Sloth Lauszus. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Sloth Lauszus
+ Web      :  http://www.lauszus.com
+ e-mail   :  lauszus@gmail.com
+*/
+
+#include <opencv2/core.hpp>
+
+#include "misc.h"
+#include "threadpool.h"
+
+using namespace cv;
+
+const uint8_t ThreadPool::MAX_THREADS;
+
+ThreadPool& ThreadPool::getInstance(void) {
+    static ThreadPool instance; // Created the first time it is used
+    return instance;
+}
+
+ThreadPool::ThreadPool(void) :
+    generation(0),
+    numThreads(1),
+    numWorkers(0),
+    pending(0),
+    stop(false),
+    numBands(0) {
+    memset(bandTime, 0, sizeof(bandTime));
+    setNumThreads(min(std::thread::hardware_concurrency(), (unsigned)MAX_THREADS)); // Use all cores by default
+}
+
+ThreadPool::~ThreadPool(void) {
+    stopWorkers();
+}
+
+void ThreadPool::setNumThreads(uint8_t nThreads) {
+    nThreads = constrain(nThreads, 1, MAX_THREADS);
+    if (nThreads == numThreads && numWorkers == nThreads - 1)
+        return;
+    stopWorkers();
+    numThreads = nThreads;
+    startWorkers();
+}
+
+void ThreadPool::startWorkers(void) {
+    stop = false;
+    numWorkers = numThreads - 1; // The calling thread processes the first band itself
+    for (uint8_t i = 0; i < numWorkers; i++)
+        workers[i] = std::thread(&ThreadPool::workerLoop, this, i + 1, generation);
+}
+
+void ThreadPool::stopWorkers(void) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    startCondition.notify_all();
+    for (uint8_t i = 0; i < numWorkers; i++)
+        workers[i].join();
+    numWorkers = 0;
+}
+
+void ThreadPool::workerLoop(uint8_t worker, uint32_t lastGeneration) {
+    while (true) {
+        uint8_t bands;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!stop && generation == lastGeneration)
+                startCondition.wait(lock);
+            if (stop)
+                return;
+            lastGeneration = generation;
+            bands = numBands;
+        }
+
+        if (worker < bands) // There might be fewer bands than threads for small images
+            runBand(worker);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--pending == 0)
+                doneCondition.notify_one();
+        }
+    }
+}
+
+void ThreadPool::runBand(uint8_t band) {
+    const double timer = (double)getTickCount();
+    const int yStart = height * band / numBands;
+    const int yStop = height * (band + 1) / numBands;
+    function(arg, yStart, yStop);
+    bandTime[band] = ((double)getTickCount() - timer) / getTickFrequency() * 1000.0;
+}
+
+void ThreadPool::run(BandFunction _function, void *_arg, int _height) {
+    static const uint8_t minRowsPerBand = 8; // Do not split small images into too many bands, as it is not worth the overhead
+
+    function = _function;
+    arg = _arg;
+    height = _height;
+    numBands = constrain(height / minRowsPerBand, 1, numThreads);
+
+    if (numBands == 1 || numWorkers == 0) {
+        numBands = 1;
+        runBand(0); // Just run it in the calling thread
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending = numWorkers;
+        generation++;
+    }
+    startCondition.notify_all();
+
+    runBand(0); // The calling thread processes the first band
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (pending > 0)
+        doneCondition.wait(lock);
+}
+
+void ThreadPool::printBandTimings(void) const {
+    for (uint8_t i = 0; i < numBands; i++)
+        printf("Band %u = %f ms\t", i, bandTime[i]);
+    printf("\n");
+}
@@ -0,0 +1,78 @@
+/* Copyright (C) 2015 Kristian Sloth Lauszus. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Sloth Lauszus
+ Web      :  http://www.lauszus.com
+ e-mail   :  lauszus@gmail.com
+*/
+
+#ifndef __threadpool_h__
+#define __threadpool_h__
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// Called with the range of rows [yStart; yStop) that a band should process
+typedef void (*BandFunction)(void *arg, int yStart, int yStop);
+
+// Persistent pool of worker threads, which is shared by all filters.
+// An image is split into horizontal bands, where each thread processes one band.
+class ThreadPool {
+public:
+    static ThreadPool& getInstance(void);
+
+    // Set the number of threads including the calling thread. Use one to run everything single-threaded
+    void setNumThreads(uint8_t nThreads);
+    uint8_t getNumThreads(void) const {
+        return numThreads;
+    }
+
+    // Split rows [0; height) into bands and run the function on all of them. Blocks until all bands are done
+    void run(BandFunction function, void *arg, int height);
+
+    // Time spent in each band during the last call to run()
+    uint8_t getNumBands(void) const {
+        return numBands;
+    }
+    double getBandTime(uint8_t band) const {
+        return bandTime[band];
+    }
+    void printBandTimings(void) const;
+
+    static const uint8_t MAX_THREADS = 16;
+
+private:
+    ThreadPool(void);
+    ~ThreadPool(void);
+
+    void startWorkers(void);
+    void stopWorkers(void);
+    void workerLoop(uint8_t worker, uint32_t lastGeneration);
+    void runBand(uint8_t band);
+
+    std::thread workers[MAX_THREADS - 1];
+    std::mutex mutex;
+    std::condition_variable startCondition, doneCondition;
+    uint32_t generation; // Incremented every time new work is available
+    uint8_t numThreads, numWorkers, pending;
+    bool stop;
+
+    // The current work
+    BandFunction function;
+    void *arg;
+    int height;
+    uint8_t numBands;
+    double bandTime[MAX_THREADS];
+};
+
+#endif
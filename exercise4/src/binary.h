@@ -0,0 +1 @@
+../../exercise3/src/binary.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../exercise3/src/border.cpp
\ No newline at end of file
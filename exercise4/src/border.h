@@ -0,0 +1 @@
+../../exercise3/src/border.h
\ No newline at end of file
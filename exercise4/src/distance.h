@@ -0,0 +1 @@
+../../exercise3/src/distance.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../exercise3/src/fft.h
\ No newline at end of file
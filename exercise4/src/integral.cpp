@@ -0,0 +1 @@
+../../exercise3/src/integral.cpp
\ No newline at end of file
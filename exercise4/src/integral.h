@@ -0,0 +1 @@
+../../exercise3/src/integral.h
\ No newline at end of file
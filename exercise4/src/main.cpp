@@ -71,16 +71,17 @@ restart:
     copyMakeBorder(imageThreshold, imageThresholdBorder, 1, 1, 1, 1, BORDER_CONSTANT); // Add a border before writing
     imwrite("img/imageThreshold.png", imageThresholdBorder);
 
-    // Apply morphological closing and opening
+    // Apply morphological closing and opening. Disks are used, as a square distorts the round outline of the pen
     Mat morphologicalFilterImg = imageThreshold.clone();
+    const StructuringElement closingElement = StructuringElement::disk(closingSize), openingElement = StructuringElement::disk(openingSize);
 
     // Morphological closing (Remove small bright spots (i.e. "salt") and connect small dark cracks)
-    morphologicalFilterImg = morphologicalFilter(&morphologicalFilterImg, DILATION, closingSize, false);
-    morphologicalFilterImg = morphologicalFilter(&morphologicalFilterImg, EROSION, closingSize, false);
+    morphologicalFilterImg = morphologicalFilter(&morphologicalFilterImg, DILATION, &closingElement, false);
+    morphologicalFilterImg = morphologicalFilter(&morphologicalFilterImg, EROSION, &closingElement, false);
 
     // Morphological opening (Remove small dark spots (i.e. "pepper") and connect small bright cracks)
-    morphologicalFilterImg = morphologicalFilter(&morphologicalFilterImg, EROSION, openingSize, false);
-    morphologicalFilterImg = morphologicalFilter(&morphologicalFilterImg, DILATION, openingSize, false);
+    morphologicalFilterImg = morphologicalFilter(&morphologicalFilterImg, EROSION, &openingElement, false);
+    morphologicalFilterImg = morphologicalFilter(&morphologicalFilterImg, DILATION, &openingElement, false);
 
     imshow("Morphological filter", morphologicalFilterImg);
     Mat morphologicalFilterImgBorder;
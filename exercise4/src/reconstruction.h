@@ -0,0 +1 @@
+../../exercise3/src/reconstruction.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../exercise3/src/threadpool.h
\ No newline at end of file